@@ -0,0 +1,263 @@
+/* Parser benchmark over a corpus of recorded payloads (users.list,
+ * channels.list, history, RTM frames, ...): for each document, times
+ * two-pass json_parse, in-situ parsing and parsing into a SlackJsonArena,
+ * and json_get_prop on every member of every object.
+ *
+ *   bench-json [-n iterations] file-or-directory...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "json.h"
+#include "slack-json.h"
+
+struct doc {
+	char *path;
+	char *json;
+	size_t len;
+};
+
+static struct doc *docs;
+static unsigned ndocs;
+
+struct totals {
+	size_t bytes;
+	double two_pass, in_situ, arena;
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static char *read_file(const char *path, size_t *len) {
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return NULL;
+	char *buf = NULL;
+	size_t siz = 0, n;
+	*len = 0;
+	do {
+		if (*len == siz)
+			buf = realloc(buf, siz = siz ? 2*siz : 65536);
+		n = fread(buf + *len, 1, siz - *len, f);
+		*len += n;
+	} while (n);
+	fclose(f);
+	return buf;
+}
+
+static int doc_cmp(const void *a, const void *b) {
+	return strcmp(((const struct doc *)a)->path, ((const struct doc *)b)->path);
+}
+
+static int load(const char *path) {
+	struct stat st;
+	if (stat(path, &st)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		DIR *dir = opendir(path);
+		if (!dir) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			return 1;
+		}
+		unsigned first = ndocs;
+		int r = 0;
+		struct dirent *ent;
+		while ((ent = readdir(dir))) {
+			if (ent->d_name[0] == '.')
+				continue;
+			char *sub = malloc(strlen(path) + strlen(ent->d_name) + 2);
+			sprintf(sub, "%s/%s", path, ent->d_name);
+			r |= load(sub);
+			free(sub);
+		}
+		closedir(dir);
+		qsort(docs + first, ndocs - first, sizeof(*docs), doc_cmp);
+		return r;
+	}
+
+	struct doc d;
+	if (!(d.json = read_file(path, &d.len))) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	d.path = strdup(path);
+	docs = realloc(docs, (ndocs + 1) * sizeof(*docs));
+	docs[ndocs++] = d;
+	return 0;
+}
+
+/* counting allocator, for allocations per document */
+static unsigned long allocs, alloc_bytes;
+
+static void *count_alloc(size_t size, int zero, void *user_data) {
+	allocs ++;
+	alloc_bytes += size;
+	return zero ? calloc(1, size) : malloc(size);
+}
+
+static void count_free(void *ptr, void *user_data) {
+	free(ptr);
+}
+
+/* every (object, member name) pair in a document, for timing lookups */
+struct lookup {
+	json_value *obj;
+	const char *name;
+};
+
+static struct lookup *lookups;
+static size_t nlookups, lookups_siz;
+
+static void collect(json_value *val) {
+	unsigned i;
+	switch (val->type) {
+		case json_object:
+			for (i = 0; i < val->u.object.length; i++) {
+				if (nlookups == lookups_siz)
+					lookups = realloc(lookups, (lookups_siz = lookups_siz ? 2*lookups_siz : 1024) * sizeof(*lookups));
+				lookups[nlookups].obj = val;
+				lookups[nlookups++].name = val->u.object.values[i].name;
+				collect(val->u.object.values[i].value);
+			}
+			break;
+		case json_array:
+			for (i = 0; i < val->u.array.length; i++)
+				collect(val->u.array.values[i]);
+			break;
+		default:
+			break;
+	}
+}
+
+static void report(const char *name, size_t len, unsigned n, double t) {
+	printf("  %-10s %10.2f us/doc %10.2f MB/s\n", name, 1e6*t/n, len*(double)n/t/1e6);
+}
+
+static int bench(struct doc *d, unsigned n, SlackJsonArena *arena, struct totals *tot) {
+	char *copy = malloc(d->len);
+	char error[json_error_max];
+	unsigned i;
+	double t;
+
+	json_settings settings = { 0 };
+	settings.mem_alloc = count_alloc;
+	settings.mem_free = count_free;
+	allocs = alloc_bytes = 0;
+	json_value *val = json_parse_ex(&settings, d->json, d->len, error);
+	if (!val) {
+		fprintf(stderr, "%s: %s\n", d->path, error);
+		free(copy);
+		return 1;
+	}
+	json_value_free_ex(&settings, val);
+
+	printf("%s: %zu bytes, %lu allocations (%lu bytes) per document\n", d->path, d->len, allocs, alloc_bytes);
+
+	memset(&settings, 0, sizeof(settings));
+	t = now();
+	for (i = 0; i < n; i++)
+		json_value_free(json_parse_ex(&settings, d->json, d->len, NULL));
+	t = now() - t;
+	report("two-pass", d->len, n, t);
+	tot->two_pass += t;
+
+	/* in-situ parsing destroys its input, so time (and subtract) the copies */
+	t = now();
+	for (i = 0; i < n; i++) {
+		memcpy(copy, d->json, d->len);
+		__asm__ __volatile__("" : : "r"(copy) : "memory");
+	}
+	double copy_t = now() - t;
+
+	settings.settings = json_in_situ;
+	t = now();
+	for (i = 0; i < n; i++) {
+		memcpy(copy, d->json, d->len);
+		json_value_free_ex(&settings, json_parse_ex(&settings, copy, d->len, NULL));
+	}
+	t = now() - t - copy_t;
+	report("in-situ", d->len, n, t);
+	tot->in_situ += t;
+
+	t = now();
+	for (i = 0; i < n; i++)
+		slack_json_release(arena, slack_json_parse(arena, d->json, d->len));
+	t = now() - t;
+	report("arena", d->len, n, t);
+	tot->arena += t;
+
+	val = slack_json_parse(arena, d->json, d->len);
+	nlookups = 0;
+	collect(val);
+	if (nlookups) {
+		json_value *volatile sink;
+		size_t j;
+		t = now();
+		for (i = 0; i < n; i++)
+			for (j = 0; j < nlookups; j++)
+				sink = json_get_prop(lookups[j].obj, lookups[j].name);
+		t = now() - t;
+		(void)sink;
+		printf("  %-10s %10.2f ns/lookup (%zu members)\n", "get_prop", 1e9*t/n/nlookups, nlookups);
+	}
+	slack_json_release(arena, val);
+
+	tot->bytes += d->len;
+	free(copy);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	unsigned n = 1000;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n iterations] file-or-directory...\n", argv[0]);
+				return 2;
+		}
+	}
+
+	int r = 0;
+	for (; optind < argc; optind++)
+		r |= load(argv[optind]);
+
+	SlackJsonArena arena;
+	slack_json_arena_init(&arena);
+
+	struct totals tot = { 0 };
+	unsigned i;
+	for (i = 0; i < ndocs; i++)
+		r |= bench(&docs[i], n, &arena, &tot);
+
+	slack_json_arena_destroy(&arena);
+
+	if (tot.bytes) {
+		printf("total: %zu bytes in %u documents\n", tot.bytes, ndocs);
+		printf("  %-10s %10.2f MB/s\n", "two-pass", tot.bytes*(double)n/tot.two_pass/1e6);
+		printf("  %-10s %10.2f MB/s\n", "in-situ", tot.bytes*(double)n/tot.in_situ/1e6);
+		printf("  %-10s %10.2f MB/s\n", "arena", tot.bytes*(double)n/tot.arena/1e6);
+	}
+
+	struct rusage ru;
+	if (!getrusage(RUSAGE_SELF, &ru))
+		printf("peak RSS: %ld KB\n", ru.ru_maxrss);
+
+	return r;
+}
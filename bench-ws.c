@@ -0,0 +1,497 @@
+/* Websocket benchmark: a child process serves ws:// on 127.0.0.1 and either
+ * blasts text messages at purple_websocket_connect, running under a minimal
+ * libpurple core on the GLib main loop (recv), or counts the messages the
+ * client sends with purple_websocket_reserve/commit (send).
+ * Received messages can be split into fragments; with -z, permessage-deflate
+ * is negotiated and both sides compress.  For each run it reports messages/s,
+ * MB/s of payload and client CPU (user+system) per message.
+ * Without -s, runs a matrix of sizes and fragmentations in both directions.
+ *
+ *   bench-ws [-z] [-d recv|send|both] [-n messages] [-s size,...] [-f fragments,...] [-w bytes per write]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include <glib.h>
+
+#include <core.h>
+#include <debug.h>
+#include <eventloop.h>
+#include <util.h>
+
+#include "purple-websocket.h"
+
+static const char WS_SALT[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+static unsigned messages = 100000;
+static size_t write_size = 65536;
+static gboolean deflate_messages;
+
+/* one benchmark run */
+struct run {
+	gboolean send; /* client to server, rather than server to client */
+	size_t size; /* of each message's payload */
+	unsigned frags; /* frames per message (received messages only) */
+	unsigned n; /* messages */
+};
+
+static double now(void) {
+	return g_get_monotonic_time() / 1e6;
+}
+
+/* GLib event loop for libpurple, as in nullclient */
+#define PURPLE_GLIB_READ_COND  (G_IO_IN | G_IO_HUP | G_IO_ERR)
+#define PURPLE_GLIB_WRITE_COND (G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL)
+
+typedef struct {
+	PurpleInputFunction function;
+	guint result;
+	gpointer data;
+} io_closure;
+
+static gboolean io_invoke(GIOChannel *source, GIOCondition condition, gpointer data) {
+	io_closure *closure = data;
+	PurpleInputCondition cond = 0;
+	if (condition & PURPLE_GLIB_READ_COND)
+		cond |= PURPLE_INPUT_READ;
+	if (condition & PURPLE_GLIB_WRITE_COND)
+		cond |= PURPLE_INPUT_WRITE;
+	closure->function(closure->data, g_io_channel_unix_get_fd(source), cond);
+	return TRUE;
+}
+
+static guint input_add(gint fd, PurpleInputCondition condition, PurpleInputFunction function, gpointer data) {
+	io_closure *closure = g_new0(io_closure, 1);
+	GIOCondition cond = 0;
+	closure->function = function;
+	closure->data = data;
+	if (condition & PURPLE_INPUT_READ)
+		cond |= PURPLE_GLIB_READ_COND;
+	if (condition & PURPLE_INPUT_WRITE)
+		cond |= PURPLE_GLIB_WRITE_COND;
+	GIOChannel *channel = g_io_channel_unix_new(fd);
+	closure->result = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT, cond, io_invoke, closure, g_free);
+	g_io_channel_unref(channel);
+	return closure->result;
+}
+
+static PurpleEventLoopUiOps eventloop_ops = {
+	g_timeout_add,
+	g_source_remove,
+	input_add,
+	g_source_remove,
+	NULL,
+	g_timeout_add_seconds,
+	NULL, NULL, NULL
+};
+
+static gboolean write_all(int fd, const char *buf, size_t len) {
+	while (len) {
+		ssize_t r = write(fd, buf, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return FALSE;
+		}
+		buf += r;
+		len -= r;
+	}
+	return TRUE;
+}
+
+static void append_frame(GString *out, guint8 header, const char *payload, size_t len) {
+	g_string_append_c(out, header);
+	if (len > 0xffff) {
+		guint64 l = GUINT64_TO_BE(len);
+		g_string_append_c(out, 127);
+		g_string_append_len(out, (char *)&l, 8);
+	} else if (len >= 126) {
+		guint16 l = GUINT16_TO_BE(len);
+		g_string_append_c(out, 126);
+		g_string_append_len(out, (char *)&l, 2);
+	} else
+		g_string_append_c(out, len);
+	g_string_append_len(out, payload, len);
+}
+
+/* compress a message with the (persistent) context, minus the trailing 00 00 ff ff */
+static void deflate_message(z_stream *z, GString *msg, GString *out) {
+	g_string_set_size(out, deflateBound(z, msg->len) + 16);
+	z->next_in = (Bytef *)msg->str;
+	z->avail_in = msg->len;
+	z->next_out = (Bytef *)out->str;
+	z->avail_out = out->len;
+	if (deflate(z, Z_SYNC_FLUSH) != Z_OK || z->avail_in)
+		_exit(1);
+	g_string_truncate(out, (char *)z->next_out - out->str - 4);
+}
+
+/* the message payload: JSON-ish text of the given size */
+static GString *make_message(size_t size) {
+	GString *msg = g_string_new("{\"type\":\"pong\",\"x\":\"");
+	while (msg->len < size)
+		g_string_append_c(msg, 'x');
+	g_string_truncate(msg, size);
+	if (size >= 3) {
+		msg->str[size-2] = '"';
+		msg->str[size-1] = '}';
+	}
+	return msg;
+}
+
+/* append a text message split into frags frames, the first with rsv */
+static void append_message(GString *out, guint8 rsv, const char *payload, size_t len, unsigned frags) {
+	unsigned i;
+	for (i = 0; i < frags; i++) {
+		size_t a = len * i / frags, b = len * (i+1) / frags;
+		append_frame(out, (i ? 0x00 : 0x01 | rsv) | (i == frags-1 ? 0x80 : 0), payload + a, b - a);
+	}
+}
+
+/* server side of a recv run: send all the messages */
+static void send_messages(int fd, const struct run *run, gboolean deflating) {
+	GString *msg = make_message(run->size);
+	GString *out = g_string_new(NULL);
+	unsigned i;
+
+	if (deflating) {
+		/* every message is compressed against the ones before it, so build each write afresh */
+		z_stream z = { 0 };
+		GString *deflated = g_string_new(NULL);
+		if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			_exit(1);
+		for (i = 0; i < run->n; ) {
+			g_string_truncate(out, 0);
+			for (; i < run->n && out->len < write_size; i++) {
+				deflate_message(&z, msg, deflated);
+				append_message(out, 0x40, deflated->str, deflated->len, run->frags);
+			}
+			if (!write_all(fd, out->str, out->len))
+				_exit(1);
+		}
+	} else {
+		/* one message, repeated to fill each write */
+		GString *frame = g_string_new(NULL);
+		append_message(frame, 0, msg->str, msg->len, run->frags);
+		unsigned per_write = MAX(write_size / frame->len, 1);
+		for (i = 0; i < per_write; i++)
+			g_string_append_len(out, frame->str, frame->len);
+
+		for (i = 0; i < run->n; i += per_write)
+			if (!write_all(fd, out->str, MIN(per_write, run->n - i) * frame->len))
+				_exit(1);
+	}
+}
+
+/* server side of a send run: count the client's messages (skipping over
+ * their payloads without unmasking them), then tell it we're done */
+static void count_messages(int fd, const struct run *run) {
+	guchar buf[65536], hdr[14];
+	size_t hlen = 0, need = 2;
+	guint64 skip = 0;
+	unsigned count = 0;
+
+	/* (counted at the header, but done only after the payload) */
+	while (count < run->n || skip) {
+		ssize_t r = read(fd, buf, sizeof(buf));
+		if (r <= 0)
+			_exit(1);
+		guchar *p = buf, *e = buf + r;
+		while (p < e && (count < run->n || skip)) {
+			if (skip) {
+				size_t k = MIN((guint64)(e - p), skip);
+				p += k;
+				skip -= k;
+				continue;
+			}
+			hdr[hlen++] = *p++;
+			if (hlen == 2)
+				need = 2 + ((hdr[1] & 0x7f) == 127 ? 8 : (hdr[1] & 0x7f) == 126 ? 2 : 0) + (hdr[1] & 0x80 ? 4 : 0);
+			if (hlen < need)
+				continue;
+
+			guint64 len = hdr[1] & 0x7f;
+			if (len == 126)
+				len = hdr[2] << 8 | hdr[3];
+			else if (len == 127) {
+				unsigned i;
+				for (len = 0, i = 0; i < 8; i++)
+					len = len << 8 | hdr[2+i];
+			}
+			/* final frames of data messages */
+			if ((hdr[0] & 0x80) && !(hdr[0] & 0x08))
+				count ++;
+			skip = len;
+			hlen = 0;
+			need = 2;
+		}
+	}
+
+	GString *out = g_string_new(NULL);
+	append_frame(out, 0x81, "done", 4);
+	if (!write_all(fd, out->str, out->len))
+		_exit(1);
+}
+
+/* the server: handshake, then the run, and wait for the client to hang up */
+static void serve(int lfd, const struct run *run) {
+	int fd = accept(lfd, NULL, NULL);
+	if (fd < 0)
+		_exit(1);
+
+	GString *req = g_string_new(NULL);
+	char buf[4096];
+	while (!strstr(req->str, "\r\n\r\n")) {
+		ssize_t r = read(fd, buf, sizeof(buf));
+		if (r <= 0)
+			_exit(1);
+		g_string_append_len(req, buf, r);
+	}
+
+	char *key = strstr(req->str, "Sec-WebSocket-Key: ");
+	if (!key)
+		_exit(1);
+	key += 19;
+	GChecksum *sha1 = g_checksum_new(G_CHECKSUM_SHA1);
+	g_checksum_update(sha1, (guchar *)key, strcspn(key, "\r\n"));
+	g_checksum_update(sha1, (guchar *)WS_SALT, strlen(WS_SALT));
+	guint8 digest[20];
+	gsize dlen = sizeof(digest);
+	g_checksum_get_digest(sha1, digest, &dlen);
+	g_checksum_free(sha1);
+	char *accept_key = g_base64_encode(digest, dlen);
+
+	gboolean deflating = deflate_messages && strstr(req->str, "permessage-deflate");
+	GString *out = g_string_new(NULL);
+	g_string_printf(out, "HTTP/1.1 101 Switching Protocols\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Accept: %s\r\n%s\r\n", accept_key,
+			deflating ? "Sec-WebSocket-Extensions: permessage-deflate\r\n" : "");
+	if (!write_all(fd, out->str, out->len))
+		_exit(1);
+
+	if (run->send)
+		count_messages(fd, run);
+	else
+		send_messages(fd, run, deflating);
+
+	while (read(fd, buf, sizeof(buf)) > 0);
+	_exit(0);
+}
+
+/* the client */
+static GMainLoop *loop;
+static PurpleWebsocket *ws;
+static const struct run *cur;
+static GString *payload;
+static unsigned received, sent;
+static double start, end, send_time;
+static struct rusage ru_start, ru_end;
+
+/* don't let more than this pile up unwritten, so sending is measured rather than buffering */
+#define SEND_QUEUE_MAX (1 << 20)
+
+static gboolean send_cb(gpointer data) {
+	if (!ws)
+		return FALSE;
+
+	double t = now();
+	unsigned i;
+	for (i = 0; i < 256 && sent < cur->n && purple_websocket_get_stats(ws)->queued < SEND_QUEUE_MAX; i++, sent++) {
+		guchar *p = purple_websocket_reserve(ws, cur->size);
+		memcpy(p, payload->str, cur->size);
+		purple_websocket_commit(ws, PURPLE_WEBSOCKET_TEXT, cur->size);
+	}
+	send_time += now() - t;
+	return sent < cur->n;
+}
+
+static void ws_cb(PurpleWebsocket *sock, gpointer user_data, PurpleWebsocketOp op, const guchar *msg, size_t len) {
+	switch (op) {
+		case PURPLE_WEBSOCKET_OPEN:
+			start = now();
+			getrusage(RUSAGE_SELF, &ru_start);
+			if (cur->send)
+				g_idle_add(send_cb, NULL);
+			break;
+		case PURPLE_WEBSOCKET_TEXT:
+			/* in a send run, this is the server saying it has them all */
+			if (cur->send || ++received == cur->n) {
+				end = now();
+				getrusage(RUSAGE_SELF, &ru_end);
+				received = cur->n;
+				g_main_loop_quit(loop);
+			}
+			break;
+		case PURPLE_WEBSOCKET_ERROR:
+			fprintf(stderr, "websocket: %.*s\n", (int)len, msg);
+			ws = NULL; /* aborted */
+			g_main_loop_quit(loop);
+			break;
+		default:
+			break;
+	}
+}
+
+static double cpu_time(const struct rusage *ru) {
+	return ru->ru_utime.tv_sec + ru->ru_stime.tv_sec + (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) / 1e6;
+}
+
+static int run_one(const struct run *run) {
+	int lfd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr = { 0 };
+	socklen_t addrlen = sizeof(addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) || listen(lfd, 1) ||
+			getsockname(lfd, (struct sockaddr *)&addr, &addrlen)) {
+		perror("listen");
+		return 1;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return 1;
+	}
+	if (!pid)
+		serve(lfd, run);
+	close(lfd);
+
+	cur = run;
+	received = sent = 0;
+	send_time = 0;
+	payload = make_message(run->size);
+
+	char *url = g_strdup_printf("ws://127.0.0.1:%d/", ntohs(addr.sin_port));
+	ws = purple_websocket_connect(NULL, url, NULL,
+			deflate_messages ? PURPLE_WEBSOCKET_DEFLATE | PURPLE_WEBSOCKET_DEFLATE_SEND : 0,
+			ws_cb, NULL);
+	if (ws)
+		g_main_loop_run(loop);
+
+	int r = 1;
+	if (received == run->n) {
+		double t = end - start;
+		double cpu = cpu_time(&ru_end) - cpu_time(&ru_start);
+		const PurpleWebsocketStats *stats = purple_websocket_get_stats(ws);
+		guint64 wire = run->send ? stats->wire_out : stats->wire_in;
+		printf("%-4s %8zu %5u %8u %11.0f %9.2f %9.2f %8.1f%%",
+				run->send ? "send" : "recv", run->size, run->frags, run->n,
+				run->n / t, run->n * (double)run->size / t / 1e6, 1e6 * cpu / run->n,
+				100.0 * wire / MAX(run->n * (double)run->size, 1));
+		if (run->send)
+			printf(" %8.1f", 1e9 * send_time / run->n);
+		printf("\n");
+		r = 0;
+	} else
+		fprintf(stderr, "%s: %u of %u messages\n", run->send ? "sent" : "received",
+				run->send ? sent : received, run->n);
+
+	if (ws)
+		purple_websocket_abort(ws);
+	waitpid(pid, NULL, 0);
+
+	g_string_free(payload, TRUE);
+	g_free(url);
+	return r;
+}
+
+/* parse a comma-separated list of numbers */
+static unsigned parse_list(const char *s, size_t *list, unsigned max) {
+	unsigned n = 0;
+	char *e;
+	while (n < max) {
+		list[n++] = strtoul(s, &e, 0);
+		if (*e != ',')
+			break;
+		s = e + 1;
+	}
+	return n;
+}
+
+#define MAX_LIST 16
+
+int main(int argc, char **argv) {
+	static size_t sizes[MAX_LIST] = { 16, 128, 1024, 16384, 262144 };
+	static size_t frags[MAX_LIST] = { 1, 4 };
+	unsigned nsizes = 5, nfrags = 2;
+	gboolean do_recv = TRUE, do_send = TRUE;
+	int opt;
+	while ((opt = getopt(argc, argv, "zd:n:s:f:w:")) != -1) {
+		switch (opt) {
+			case 'z':
+				deflate_messages = TRUE;
+				break;
+			case 'd':
+				do_recv = strcmp(optarg, "send");
+				do_send = strcmp(optarg, "recv");
+				break;
+			case 'n':
+				messages = strtoul(optarg, NULL, 0);
+				break;
+			case 's':
+				nsizes = parse_list(optarg, sizes, MAX_LIST);
+				break;
+			case 'f':
+				nfrags = parse_list(optarg, frags, MAX_LIST);
+				break;
+			case 'w':
+				write_size = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-z] [-d recv|send|both] [-n messages] [-s size,...] [-f fragments,...] [-w bytes per write]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (!messages)
+		return 0;
+
+	char *dir = g_dir_make_tmp("bench-ws-XXXXXX", NULL);
+	purple_util_set_user_dir(dir);
+	purple_debug_set_enabled(FALSE);
+	purple_eventloop_set_ui_ops(&eventloop_ops);
+	if (!purple_core_init("bench-ws")) {
+		fprintf(stderr, "libpurple initialization failed\n");
+		return 1;
+	}
+	loop = g_main_loop_new(NULL, FALSE);
+
+	printf("%s, %zu bytes per server write\n", deflate_messages ? "permessage-deflate" : "uncompressed", write_size);
+	printf("dir      size frags messages  messages/s      MB/s us CPU/msg     wire ns in send\n");
+
+	int r = 0;
+	unsigned s, f;
+	for (s = 0; s < nsizes; s++) {
+		struct run run = { 0 };
+		run.size = sizes[s];
+		/* keep big messages to a few hundred MB */
+		run.n = MIN(messages, MAX((256u << 20) / MAX(run.size, 1), 100));
+		if (do_recv)
+			for (f = 0; f < nfrags; f++) {
+				run.frags = MAX(frags[f], 1);
+				r |= run_one(&run);
+			}
+		if (do_send) {
+			run.send = TRUE;
+			run.frags = 1;
+			r |= run_one(&run);
+		}
+	}
+
+	purple_core_quit();
+	g_main_loop_unref(loop);
+	g_free(dir);
+	return r;
+}
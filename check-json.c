@@ -0,0 +1,107 @@
+/* Checks the SIMD scanning kernels in json.c against a byte-at-a-time
+ * reference: every kernel the CPU supports is run on random buffers at
+ * each alignment, for lengths around the 16 and 32 byte blocks, with a
+ * byte that stops the scan placed at each position (and more after it).
+ *
+ *   check-json
+ */
+
+/* the kernels are static */
+#include "json.c"
+
+#include <stdlib.h>
+
+#define MAX_ALIGN 32
+#define MAX_LEN 100
+
+struct kernel {
+	const char *name;
+	json_scan string, ws;
+	int supported;
+};
+
+static const json_char *ref_string(const json_char *p, const json_char *end) {
+	for (; p < end; p++)
+		if (*p == '"' || *p == '\\' || (unsigned char)*p < 0x20)
+			break;
+	return p;
+}
+
+static const json_char *ref_ws(const json_char *p, const json_char *end) {
+	for (; p < end; p++)
+		if (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+			break;
+	return p;
+}
+
+/* bytes that stop each scan, and some that (only just) don't */
+static const unsigned char string_stop[] = { '"', '\\', 0x00, 0x01, '\n', 0x1f };
+static const unsigned char string_pass[] = { ' ', '!', '#', '[', ']', 'a', 0x7f, 0x80, 0xc3, 0xe0, 0xff };
+static const unsigned char ws_stop[] = { 0x00, 0x08, 0x0b, 0x0c, 0x0e, '!', '"', 'a', 0x80, 0xa0, 0xff };
+static const unsigned char ws_pass[] = { ' ', '\t', '\r', '\n' };
+
+static unsigned failures;
+
+static void check(const struct kernel *k, const char *what, json_scan scan, json_scan ref,
+		const json_char *p, size_t len) {
+	const json_char *want = ref(p, p + len), *got = scan(p, p + len);
+	if (got == want)
+		return;
+	if (failures++ < 10)
+		fprintf(stderr, "%s %s: length %zu at alignment %u: got %td, want %td\n",
+				k->name, what, len, (unsigned)((size_t)p % MAX_ALIGN), got - p, want - p);
+}
+
+/* Fill buf with bytes that don't stop the scan, then put one that does at
+ * pos (if inside len), maybe another after it, and more just past the end,
+ * which mustn't be read */
+static void fill(unsigned char *buf, size_t len, size_t pos,
+		const unsigned char *stop, size_t nstop, const unsigned char *pass, size_t npass) {
+	size_t i;
+	for (i = 0; i < len; i++)
+		buf[i] = pass[rand() % npass];
+	if (pos < len) {
+		buf[pos] = stop[rand() % nstop];
+		if (rand() % 2)
+			buf[pos + rand() % (len - pos)] = stop[rand() % nstop];
+	}
+	for (i = len; i < len + 32; i++)
+		buf[i] = stop[rand() % nstop];
+}
+
+int main(void) {
+	struct kernel kernels[] = {
+		{ "scalar", scan_string_scalar, scan_ws_scalar, 1 },
+#ifdef JSON_SCAN_X86
+		{ "sse2", scan_string_sse2, scan_ws_sse2, __builtin_cpu_supports("sse2") },
+		{ "avx2", scan_string_avx2, scan_ws_avx2, __builtin_cpu_supports("avx2") },
+#endif
+	};
+	static unsigned char mem[MAX_ALIGN + MAX_LEN + 32] __attribute__((aligned(MAX_ALIGN)));
+	unsigned k, align;
+	size_t len, pos;
+
+	srand(1);
+	for (k = 0; k < sizeof(kernels) / sizeof(*kernels); k++) {
+		if (!kernels[k].supported) {
+			printf("%s: not supported, skipped\n", kernels[k].name);
+			continue;
+		}
+		for (align = 0; align < MAX_ALIGN; align++)
+			for (len = 0; len <= MAX_LEN; len++)
+				for (pos = 0; pos <= len; pos++) {
+					unsigned char *buf = mem + align;
+					fill(buf, len, pos, string_stop, sizeof(string_stop), string_pass, sizeof(string_pass));
+					check(&kernels[k], "scan_string", kernels[k].string, ref_string, (json_char *)buf, len);
+					fill(buf, len, pos, ws_stop, sizeof(ws_stop), ws_pass, sizeof(ws_pass));
+					check(&kernels[k], "scan_ws", kernels[k].ws, ref_ws, (json_char *)buf, len);
+				}
+		printf("%s: checked\n", kernels[k].name);
+	}
+
+	if (failures) {
+		printf("%u mismatches\n", failures);
+		return 1;
+	}
+	return 0;
+}
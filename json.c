@@ -99,12 +99,46 @@ static void * json_alloc (json_state * state, unsigned long size, int zero)
    return state->settings.mem_alloc (size, zero, state->settings.user_data);
 }
 
+/* Objects with at least index_min members get space for a lookup index after
+ * their entries when json_index_objects is set: a mask followed by an open
+ * addressing table of entry numbers, built by the first json_object_get.
+ */
+#define index_min 32
+#define index_max 16384
+
+static unsigned int index_size (json_state * state, unsigned int length)
+{
+   unsigned int slots = 64;
+
+   if (! (state->settings.settings & json_index_objects)
+         || length < index_min || length > index_max)
+   {
+      return 0;
+   }
+
+   while (slots < length * 2)
+      slots <<= 1;
+
+   return (slots + 1) * sizeof (unsigned short);
+}
+
+unsigned int json_hash (const json_char * name, unsigned int length)
+{
+   unsigned int hash = 2166136261u;
+
+   while (length --)
+      hash = (hash ^ (unsigned char) *name ++) * 16777619u;
+
+   return hash;
+}
+
 static int new_value (json_state * state,
                       json_value ** top, json_value ** root, json_value ** alloc,
                       json_type type)
 {
    json_value * value;
-   int values_size;
+   int values_size, index_bytes;
+   char * mem;
 
    if (!state->first_pass)
    {
@@ -136,14 +170,20 @@ static int new_value (json_state * state,
                break;
 
             values_size = sizeof (*value->u.object.values) * value->u.object.length;
+            index_bytes = index_size (state, value->u.object.length);
 
-            if (! (value->u.object.values = (json_object_entry *) json_alloc
-                  (state, values_size + ((unsigned long) value->u.object.values), 0)) )
+            if (! (mem = (char *) json_alloc
+                  (state, values_size + index_bytes + ((unsigned long) value->u.object.values), 0)) )
             {
                return 0;
             }
 
-            value->_reserved.object_mem = (*(char **) &value->u.object.values) + values_size;
+            value->u.object.values = (json_object_entry *) mem;
+
+            if (index_bytes)
+               *(unsigned short *) (mem + values_size) = 0;
+
+            value->_reserved.object_mem = mem + values_size + index_bytes;
 
             value->u.object.length = 0;
             break;
@@ -218,6 +258,818 @@ static const long
    flag_line_comment     = 1 << 13,
    flag_block_comment    = 1 << 14;
 
+/* Scanning kernels
+ *
+ * scan_string finds the next byte that can't be copied straight into a string
+ * (a quote, backslash or control character) and scan_ws the next byte that
+ * isn't whitespace, or end.  The implementation is picked on first use: AVX2
+ * or SSE2 where the CPU has them, a byte at a time otherwise (or always, with
+ * JSON_NO_SIMD defined).
+ */
+
+typedef const json_char * (* json_scan) (const json_char * p, const json_char * end);
+
+#define is_ws(c)  ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+
+static const json_char * scan_string_scalar (const json_char * p, const json_char * end)
+{
+   while (p < end && *p != '"' && *p != '\\' && (unsigned char) *p >= 0x20)
+      ++ p;
+
+   return p;
+}
+
+static const json_char * scan_ws_scalar (const json_char * p, const json_char * end)
+{
+   while (p < end && is_ws (*p))
+      ++ p;
+
+   return p;
+}
+
+#if !defined (JSON_NO_SIMD) && (defined (__x86_64__) || defined (__i386__)) \
+      && defined (__GNUC__)
+
+   #define JSON_SCAN_X86
+   #include <immintrin.h>
+
+__attribute__ ((target ("sse2")))
+static const json_char * scan_string_sse2 (const json_char * p, const json_char * end)
+{
+   const __m128i quote = _mm_set1_epi8 ('"'), backslash = _mm_set1_epi8 ('\\'),
+                 control = _mm_set1_epi8 (0x1F);
+   __m128i v;
+   int mask;
+
+   for (; end - p >= 16; p += 16)
+   {
+      v = _mm_loadu_si128 ((const __m128i *) p);
+
+      mask = _mm_movemask_epi8 (_mm_or_si128 (
+               _mm_or_si128 (_mm_cmpeq_epi8 (v, quote), _mm_cmpeq_epi8 (v, backslash)),
+               _mm_cmpeq_epi8 (_mm_max_epu8 (v, control), control)));
+
+      if (mask)
+         return p + __builtin_ctz (mask);
+   }
+
+   return scan_string_scalar (p, end);
+}
+
+__attribute__ ((target ("sse2")))
+static const json_char * scan_ws_sse2 (const json_char * p, const json_char * end)
+{
+   const __m128i space = _mm_set1_epi8 (' '), tab = _mm_set1_epi8 ('\t'),
+                 cr = _mm_set1_epi8 ('\r'), lf = _mm_set1_epi8 ('\n');
+   __m128i v;
+   int mask;
+
+   for (; end - p >= 16; p += 16)
+   {
+      v = _mm_loadu_si128 ((const __m128i *) p);
+
+      mask = 0xFFFF ^ _mm_movemask_epi8 (_mm_or_si128 (
+               _mm_or_si128 (_mm_cmpeq_epi8 (v, space), _mm_cmpeq_epi8 (v, tab)),
+               _mm_or_si128 (_mm_cmpeq_epi8 (v, cr), _mm_cmpeq_epi8 (v, lf))));
+
+      if (mask)
+         return p + __builtin_ctz (mask);
+   }
+
+   return scan_ws_scalar (p, end);
+}
+
+__attribute__ ((target ("avx2")))
+static const json_char * scan_string_avx2 (const json_char * p, const json_char * end)
+{
+   const __m256i quote = _mm256_set1_epi8 ('"'), backslash = _mm256_set1_epi8 ('\\'),
+                 control = _mm256_set1_epi8 (0x1F);
+   __m256i v;
+   unsigned int mask;
+
+   for (; end - p >= 32; p += 32)
+   {
+      v = _mm256_loadu_si256 ((const __m256i *) p);
+
+      mask = _mm256_movemask_epi8 (_mm256_or_si256 (
+               _mm256_or_si256 (_mm256_cmpeq_epi8 (v, quote), _mm256_cmpeq_epi8 (v, backslash)),
+               _mm256_cmpeq_epi8 (_mm256_max_epu8 (v, control), control)));
+
+      if (mask)
+         return p + __builtin_ctz (mask);
+   }
+
+   return scan_string_sse2 (p, end);
+}
+
+__attribute__ ((target ("avx2")))
+static const json_char * scan_ws_avx2 (const json_char * p, const json_char * end)
+{
+   const __m256i space = _mm256_set1_epi8 (' '), tab = _mm256_set1_epi8 ('\t'),
+                 cr = _mm256_set1_epi8 ('\r'), lf = _mm256_set1_epi8 ('\n');
+   __m256i v;
+   unsigned int mask;
+
+   for (; end - p >= 32; p += 32)
+   {
+      v = _mm256_loadu_si256 ((const __m256i *) p);
+
+      mask = ~ (unsigned int) _mm256_movemask_epi8 (_mm256_or_si256 (
+               _mm256_or_si256 (_mm256_cmpeq_epi8 (v, space), _mm256_cmpeq_epi8 (v, tab)),
+               _mm256_or_si256 (_mm256_cmpeq_epi8 (v, cr), _mm256_cmpeq_epi8 (v, lf))));
+
+      if (mask)
+         return p + __builtin_ctz (mask);
+   }
+
+   return scan_ws_sse2 (p, end);
+}
+
+#endif
+
+static const json_char * scan_string_init (const json_char * p, const json_char * end);
+static const json_char * scan_ws_init (const json_char * p, const json_char * end);
+
+static json_scan scan_string = scan_string_init, scan_ws = scan_ws_init;
+
+static void scan_init (void)
+{
+   scan_string = scan_string_scalar;
+   scan_ws = scan_ws_scalar;
+
+   #ifdef JSON_SCAN_X86
+      if (__builtin_cpu_supports ("avx2"))
+      {  scan_string = scan_string_avx2;
+         scan_ws = scan_ws_avx2;
+      }
+      else if (__builtin_cpu_supports ("sse2"))
+      {  scan_string = scan_string_sse2;
+         scan_ws = scan_ws_sse2;
+      }
+   #endif
+}
+
+static const json_char * scan_string_init (const json_char * p, const json_char * end)
+{
+   scan_init ();
+   return scan_string (p, end);
+}
+
+static const json_char * scan_ws_init (const json_char * p, const json_char * end)
+{
+   scan_init ();
+   return scan_ws (p, end);
+}
+
+/* In-situ parsing (json_in_situ)
+ *
+ * Strings are unescaped in place and the resulting values point into the
+ * source buffer, which must be writable and outlive them.  Everything is
+ * done in a single pass: the children of open containers are collected on a
+ * scratch stack, and copied into an exactly sized array when the container
+ * closes.
+ */
+
+typedef struct
+{
+   json_object_entry * entries;
+   unsigned int length, size;
+
+} json_scratch;
+
+static int scratch_push (json_scratch * scratch,
+                         json_char * name, unsigned int name_length)
+{
+   json_object_entry * entry;
+
+   if (scratch->length == scratch->size)
+   {
+      unsigned int size = scratch->size ? scratch->size * 2 : 64;
+
+      if (size < scratch->size || size > ((size_t) -1) / sizeof (*entry))
+         return 0;
+
+      /* scratch space is always malloc'd, as the allocator may not free */
+      if (! (entry = (json_object_entry *) realloc
+               (scratch->entries, size * sizeof (*entry))) )
+      {
+         return 0;
+      }
+
+      scratch->entries = entry;
+      scratch->size = size;
+   }
+
+   entry = &scratch->entries [scratch->length ++];
+   entry->name = name;
+   entry->name_length = name_length;
+   entry->name_hash = name ? json_hash (name, name_length) : 0;
+   entry->value = 0;
+
+   return 1;
+}
+
+static void in_situ_position (const json_char * json, const json_char * ptr,
+                              unsigned int * line, unsigned int * col)
+{
+   *line = 1;
+   *col = 0;
+
+   for (; json < ptr; ++ json)
+   {
+      if (*json == '\n')
+      {  ++ *line;
+         *col = 0;
+      }
+      else
+         ++ *col;
+   }
+}
+
+/* Skip whitespace (and comments, if enabled); 0 on an unterminated comment
+ */
+static int in_situ_skip (json_state * state, json_char ** ptr, const json_char * end)
+{
+   json_char * p = *ptr;
+
+   for (;;)
+   {
+      /* runs of more than one are left to scan_ws */
+      if (p < end && is_ws (*p) && ++ p < end && is_ws (*p))
+         p = (json_char *) scan_ws (p, end);
+
+      if (! (state->settings.settings & json_enable_comments)
+            || end - p < 2 || *p != '/')
+      {
+         break;
+      }
+
+      if (p [1] == '/')
+      {
+         while (p < end && *p != '\r' && *p != '\n')
+            ++ p;
+      }
+      else if (p [1] == '*')
+      {
+         for (p += 2 ;; ++ p)
+         {
+            if (end - p < 2)
+            {  *ptr = p;
+               return 0;
+            }
+
+            if (p [0] == '*' && p [1] == '/')
+               break;
+         }
+
+         p += 2;
+      }
+      else
+         break;
+   }
+
+   *ptr = p;
+   return 1;
+}
+
+/* Unescape the string starting after the opening quote in place, and
+ * terminate it (at worst over the closing quote)
+ */
+static int in_situ_string (json_char ** ptr, const json_char * end,
+                           unsigned int * length)
+{
+   json_char * r = *ptr, * w = r;
+   json_uchar uchar, uchar2;
+   unsigned char uc_b1, uc_b2, uc_b3, uc_b4;
+
+   for (;;)
+   {
+      json_char * plain = (json_char *) scan_string (r, end);
+
+      if (w != r)
+         memmove (w, r, plain - r);
+
+      w += plain - r;
+      r = plain;
+
+      if (r == end || !*r)
+      {  *ptr = r;
+         return 0;
+      }
+
+      if (*r == '"')
+         break;
+
+      if (*r != '\\')
+      {
+         *w ++ = *r ++;
+         continue;
+      }
+
+      if (++ r == end)
+      {  *ptr = r;
+         return 0;
+      }
+
+      switch (*r ++)
+      {
+         case 'b':  *w ++ = '\b';  break;
+         case 'f':  *w ++ = '\f';  break;
+         case 'n':  *w ++ = '\n';  break;
+         case 'r':  *w ++ = '\r';  break;
+         case 't':  *w ++ = '\t';  break;
+         case 'u':
+
+           if (end - r < 4 ||
+               (uc_b1 = hex_value (r [0])) == 0xFF ||
+               (uc_b2 = hex_value (r [1])) == 0xFF ||
+               (uc_b3 = hex_value (r [2])) == 0xFF ||
+               (uc_b4 = hex_value (r [3])) == 0xFF)
+           {
+              *ptr = r - 1;
+              return -1;
+           }
+
+           r += 4;
+           uchar = (((uc_b1 << 4) | uc_b2) << 8) | ((uc_b3 << 4) | uc_b4);
+
+           if ((uchar & 0xF800) == 0xD800)
+           {
+              if (end - r < 6 || r [0] != '\\' || r [1] != 'u' ||
+                  (uc_b1 = hex_value (r [2])) == 0xFF ||
+                  (uc_b2 = hex_value (r [3])) == 0xFF ||
+                  (uc_b3 = hex_value (r [4])) == 0xFF ||
+                  (uc_b4 = hex_value (r [5])) == 0xFF)
+              {
+                 *ptr = r;
+                 return -1;
+              }
+
+              r += 6;
+              uchar2 = (((uc_b1 << 4) | uc_b2) << 8) | ((uc_b3 << 4) | uc_b4);
+              uchar = 0x010000 | ((uchar & 0x3FF) << 10) | (uchar2 & 0x3FF);
+           }
+
+           if (sizeof (json_char) >= sizeof (json_uchar) || (uchar <= 0x7F))
+              *w ++ = (json_char) uchar;
+           else if (uchar <= 0x7FF)
+           {  *w ++ = 0xC0 | (uchar >> 6);
+              *w ++ = 0x80 | (uchar & 0x3F);
+           }
+           else if (uchar <= 0xFFFF)
+           {  *w ++ = 0xE0 | (uchar >> 12);
+              *w ++ = 0x80 | ((uchar >> 6) & 0x3F);
+              *w ++ = 0x80 | (uchar & 0x3F);
+           }
+           else
+           {  *w ++ = 0xF0 | (uchar >> 18);
+              *w ++ = 0x80 | ((uchar >> 12) & 0x3F);
+              *w ++ = 0x80 | ((uchar >> 6) & 0x3F);
+              *w ++ = 0x80 | (uchar & 0x3F);
+           }
+
+           break;
+
+         default:
+            *w ++ = r [-1];
+      };
+   }
+
+   *length = w - *ptr;
+   *w = 0;
+   *ptr = r + 1;
+
+   return 1;
+}
+
+#ifdef JSON_TRACK_SOURCE
+   #define in_situ_track(value, json, ptr) \
+      in_situ_position (json, ptr, &(value)->line, &(value)->col)
+#else
+   #define in_situ_track(value, json, ptr)
+#endif
+
+static json_value * in_situ_value (json_state * state, json_value * parent,
+                                   json_type type)
+{
+   json_value * value;
+
+   if (! (value = (json_value *) json_alloc
+         (state, sizeof (json_value) + state->settings.value_extra, 1)))
+   {
+      return 0;
+   }
+
+   value->type = type;
+   value->parent = parent;
+
+   return value;
+}
+
+/* Close the container at top, moving its children off the scratch stack
+ */
+static int in_situ_close (json_state * state, json_scratch * scratch, json_value * top)
+{
+   unsigned int start = top->u.array.length,
+                length = scratch->length - start;
+
+   top->u.array.length = 0;
+
+   if (!length)
+      return 1;
+
+   if (top->type == json_array)
+   {
+      unsigned int i;
+
+      if (! (top->u.array.values = (json_value **) json_alloc
+               (state, length * sizeof (json_value *), 0)) )
+      {
+         return 0;
+      }
+
+      for (i = 0; i < length; ++ i)
+         top->u.array.values [i] = scratch->entries [start + i].value;
+   }
+   else
+   {
+      unsigned int values_size = length * sizeof (json_object_entry),
+                   index_bytes = index_size (state, length);
+
+      if (! (top->u.object.values = (json_object_entry *) json_alloc
+               (state, values_size + index_bytes, 0)) )
+      {
+         return 0;
+      }
+
+      memcpy (top->u.object.values, &scratch->entries [start], values_size);
+
+      if (index_bytes)
+      {
+         top->_reserved.object_mem = ((char *) top->u.object.values) + values_size;
+         *(unsigned short *) top->_reserved.object_mem = 0;
+      }
+   }
+
+   top->u.array.length = length;
+   scratch->length = start;
+
+   return 1;
+}
+
+static json_value * json_parse_in_situ (json_state * state,
+                                        json_char * json,
+                                        size_t length,
+                                        char * error_buf)
+{
+   json_char error [json_error_max];
+   json_char * const end = json + length;
+   json_char * p = json, * name;
+   json_value * top = 0, * value = 0, * loose = 0;
+   json_scratch scratch = { 0 };
+   unsigned int line, col, string_length;
+   int r;
+
+   /* loose is a value that has not been handed to its container yet */
+   #define new_in_situ(type) \
+      do { if (! (loose = value = in_situ_value (state, top, type))) \
+              goto e_alloc_failure; \
+           in_situ_track (value, json, p); \
+      } while (0)
+
+   error [0] = '\0';
+
+seek_value:
+
+   if (!in_situ_skip (state, &p, end))
+      goto e_comment;
+
+   if (p == end)
+      goto e_eof;
+
+   switch (*p)
+   {
+      case '{':
+      case '[':
+
+         new_in_situ (*p == '{' ? json_object : json_array);
+         ++ p;
+
+         /* remember where this container's children start */
+         value->u.array.length = scratch.length;
+         top = value;
+         loose = 0;
+
+         if (top->type == json_object)
+            goto seek_name;
+
+         goto seek_value;
+
+      case ']':
+
+         if (!top || top->type != json_array)
+         {  sprintf (error, "Unexpected ]");
+            goto e_failed_at;
+         }
+
+         ++ p;
+         goto close;
+
+      case '"':
+
+         new_in_situ (json_string);
+         ++ p;
+
+         value->u.string.ptr = p;
+
+         if ((r = in_situ_string (&p, end, &string_length)) <= 0)
+            goto e_string;
+
+         value->u.string.length = string_length;
+         goto got_value;
+
+      case 't':
+
+         if ((end - p) < 4 || memcmp (p, "true", 4))
+            goto e_unknown_value;
+
+         new_in_situ (json_boolean);
+         value->u.boolean = 1;
+         p += 4;
+         goto got_value;
+
+      case 'f':
+
+         if ((end - p) < 5 || memcmp (p, "false", 5))
+            goto e_unknown_value;
+
+         new_in_situ (json_boolean);
+         p += 5;
+         goto got_value;
+
+      case 'n':
+
+         if ((end - p) < 4 || memcmp (p, "null", 4))
+            goto e_unknown_value;
+
+         new_in_situ (json_null);
+         p += 4;
+         goto got_value;
+
+      default:
+
+         if (isdigit (*p) || *p == '-')
+         {
+            int negative = 0;
+            json_int_t num_fraction = 0;
+            long num_digits = 0, num_e = 0;
+
+            new_in_situ (json_integer);
+
+            if (*p == '-')
+            {  negative = 1;
+               ++ p;
+            }
+
+            for (; p < end && isdigit (*p); ++ p, ++ num_digits)
+            {
+               if (num_digits == 1 && value->u.integer == 0)
+               {  sprintf (error, "Unexpected `0` before `%c`", *p);
+                  goto e_failed_at;
+               }
+
+               value->u.integer = (value->u.integer * 10) + (*p - '0');
+            }
+
+            if (!num_digits)
+            {  sprintf (error, "Expected digit");
+               goto e_failed_at;
+            }
+
+            if (p < end && *p == '.')
+            {
+               value->type = json_double;
+               value->u.dbl = (double) value->u.integer;
+
+               for (num_digits = 0, ++ p; p < end && isdigit (*p); ++ p, ++ num_digits)
+                  num_fraction = (num_fraction * 10) + (*p - '0');
+
+               if (!num_digits)
+               {  sprintf (error, "Expected digit after `.`");
+                  goto e_failed_at;
+               }
+
+               value->u.dbl += ((double) num_fraction) / (pow (10.0, (double) num_digits));
+            }
+
+            if (p < end && (*p == 'e' || *p == 'E'))
+            {
+               int e_negative = 0;
+
+               if (value->type == json_integer)
+               {
+                  value->type = json_double;
+                  value->u.dbl = (double) value->u.integer;
+               }
+
+               if (++ p < end && (*p == '+' || *p == '-'))
+                  e_negative = (*p ++ == '-');
+
+               for (num_digits = 0; p < end && isdigit (*p); ++ p, ++ num_digits)
+                  num_e = (num_e * 10) + (*p - '0');
+
+               if (!num_digits)
+               {  sprintf (error, "Expected digit after `e`");
+                  goto e_failed_at;
+               }
+
+               value->u.dbl *= pow (10.0, (double) (e_negative ? - num_e : num_e));
+            }
+
+            if (negative)
+            {
+               if (value->type == json_integer)
+                  value->u.integer = - value->u.integer;
+               else
+                  value->u.dbl = - value->u.dbl;
+            }
+
+            goto got_value;
+         }
+
+         sprintf (error, "Unexpected %c when seeking value", *p);
+         goto e_failed_at;
+   };
+
+close:
+
+   if (!in_situ_close (state, &scratch, top))
+      goto e_alloc_failure;
+
+   loose = value = top;
+   top = top->parent;
+
+got_value:
+
+   /* value is complete: hand it to its container */
+
+   if (!top)
+   {
+      if (!in_situ_skip (state, &p, end))
+         goto e_comment;
+
+      if (p != end)
+      {  sprintf (error, "Trailing garbage: `%c`", *p);
+         goto e_failed_at;
+      }
+
+      free (scratch.entries);
+      return value;
+   }
+
+   if (top->type == json_array)
+   {
+      if (!scratch_push (&scratch, 0, 0))
+         goto e_alloc_failure;
+   }
+
+   scratch.entries [scratch.length - 1].value = value;
+   loose = 0;
+
+   if (!in_situ_skip (state, &p, end))
+      goto e_comment;
+
+   if (p == end)
+      goto e_eof;
+
+   if (*p == ',')
+   {
+      ++ p;
+
+      if (top->type == json_object)
+         goto seek_name;
+
+      goto seek_value;
+   }
+
+   if (*p == (top->type == json_object ? '}' : ']'))
+   {
+      ++ p;
+      goto close;
+   }
+
+   sprintf (error, "Expected , before %c", *p);
+   goto e_failed_at;
+
+seek_name:
+
+   if (!in_situ_skip (state, &p, end))
+      goto e_comment;
+
+   if (p == end)
+      goto e_eof;
+
+   if (*p == '}')
+   {
+      ++ p;
+      goto close;
+   }
+
+   if (*p != '"')
+   {  sprintf (error, "Unexpected `%c` in object", *p);
+      goto e_failed_at;
+   }
+
+   name = ++ p;
+
+   if ((r = in_situ_string (&p, end, &string_length)) <= 0)
+      goto e_string;
+
+   if (!scratch_push (&scratch, name, string_length))
+      goto e_alloc_failure;
+
+   if (!in_situ_skip (state, &p, end))
+      goto e_comment;
+
+   if (p == end || *p != ':')
+   {  sprintf (error, "Expected : before %c", p == end ? ' ' : *p);
+      goto e_failed_at;
+   }
+
+   ++ p;
+   goto seek_value;
+
+e_string:
+
+   if (!r)
+      goto e_eof;
+
+   sprintf (error, "Invalid character value");
+   goto e_failed_at;
+
+e_unknown_value:
+
+   sprintf (error, "Unknown value");
+   goto e_failed_at;
+
+e_comment:
+
+   sprintf (error, "Unexpected EOF in block comment");
+   goto e_failed_at;
+
+e_eof:
+
+   sprintf (error, "Unexpected EOF");
+   goto e_failed_at;
+
+e_alloc_failure:
+
+   strcpy (error, "Memory allocation failure");
+   goto e_failed;
+
+e_failed_at:
+
+   in_situ_position (json, p, &line, &col);
+   string_length = strlen (error);
+   snprintf (error + string_length, sizeof (error) - string_length,
+             " (at %d:%d)", line, col);
+
+e_failed:
+
+   if (error_buf)
+      strcpy (error_buf, error);
+
+   /* Everything allocated so far is either loose, an open container (whose
+    * children are still on the scratch stack), or a complete value on the
+    * scratch stack.
+    */
+   if (loose)
+      json_value_free_ex (&state->settings, loose);
+
+   for (string_length = 0; string_length < scratch.length; ++ string_length)
+   {
+      if (scratch.entries [string_length].value)
+         json_value_free_ex (&state->settings, scratch.entries [string_length].value);
+   }
+
+   free (scratch.entries);
+
+   while (top)
+   {
+      value = top->parent;
+
+      if (top->u.array.values)
+         state->settings.mem_free (top->u.array.values, state->settings.user_data);
+
+      state->settings.mem_free (top, state->settings.user_data);
+      top = value;
+   }
+
+   return 0;
+
+   #undef new_in_situ
+}
+
 json_value * json_parse_ex (json_settings * settings,
                             const json_char * json,
                             size_t length,
@@ -258,12 +1110,16 @@ json_value * json_parse_ex (json_settings * settings,
    state.uint_max -= 8; /* limit of how much can be added before next check */
    state.ulong_max -= 8;
 
+   if (state.settings.settings & json_in_situ)
+      return json_parse_in_situ (&state, (json_char *) json, length, error_buf);
+
    for (state.first_pass = 1; state.first_pass >= 0; -- state.first_pass)
    {
       json_uchar uchar;
       unsigned char uc_b1, uc_b2, uc_b3, uc_b4;
       json_char * string = 0;
       unsigned int string_length = 0;
+      size_t run;
 
       top = root = 0;
       flags = flag_seek_value;
@@ -414,6 +1270,9 @@ json_value * json_parse_ex (json_settings * settings,
                         top->u.object.values [top->u.object.length].name_length
                            = string_length;
 
+                        top->u.object.values [top->u.object.length].name_hash
+                           = json_hash ((json_char *) top->_reserved.object_mem, string_length);
+
                         (*(json_char **) &top->_reserved.object_mem) += string_length + 1;
                      }
 
@@ -427,6 +1286,19 @@ json_value * json_parse_ex (json_settings * settings,
             else
             {
                string_add (b);
+
+               /* and the rest of the run of plain characters with it */
+               run = scan_string (state.ptr + 1, end) - (state.ptr + 1);
+
+               if (run > state.uint_max - string_length)
+                  goto e_overflow;
+
+               if (!state.first_pass)
+                  memcpy (string + string_length, state.ptr + 1, run);
+
+               string_length += run;
+               state.ptr += run;
+
                continue;
             }
          }
@@ -713,6 +1585,15 @@ json_value * json_parse_ex (json_settings * settings,
                   case '}':
 
                      flags = (flags & ~ flag_need_comma) | flag_next;
+
+                     /* the names are done with: point at the index instead */
+                     if (!state.first_pass)
+                     {
+                        top->_reserved.object_mem =
+                           index_size (&state, top->u.object.length) ?
+                              (char *) (top->u.object.values + top->u.object.length) : 0;
+                     }
+
                      break;
 
                   case ',':
@@ -955,10 +1836,14 @@ json_value * json_parse (const json_char * json, size_t length)
 void json_value_free_ex (json_settings * settings, json_value * value)
 {
    json_value * cur_value;
+   void (* mem_free) (void *, void * user_data) = settings->mem_free;
 
    if (!value)
       return;
 
+   if (!mem_free)
+      mem_free = default_free;
+
    value->parent = 0;
 
    while (value)
@@ -969,7 +1854,7 @@ void json_value_free_ex (json_settings * settings, json_value * value)
 
             if (!value->u.array.length)
             {
-               settings->mem_free (value->u.array.values, settings->user_data);
+               mem_free (value->u.array.values, settings->user_data);
                break;
             }
 
@@ -980,7 +1865,7 @@ void json_value_free_ex (json_settings * settings, json_value * value)
 
             if (!value->u.object.length)
             {
-               settings->mem_free (value->u.object.values, settings->user_data);
+               mem_free (value->u.object.values, settings->user_data);
                break;
             }
 
@@ -989,7 +1874,9 @@ void json_value_free_ex (json_settings * settings, json_value * value)
 
          case json_string:
 
-            settings->mem_free (value->u.string.ptr, settings->user_data);
+            if (! (settings->settings & json_in_situ))
+               mem_free (value->u.string.ptr, settings->user_data);
+
             break;
 
          default:
@@ -998,8 +1885,75 @@ void json_value_free_ex (json_settings * settings, json_value * value)
 
       cur_value = value;
       value = value->parent;
-      settings->mem_free (cur_value, settings->user_data);
+      mem_free (cur_value, settings->user_data);
+   }
+}
+
+static void index_build (const json_value * object, unsigned short * index)
+{
+   unsigned int mask = 63, i, slot;
+
+   while (mask + 1 < object->u.object.length * 2)
+      mask = (mask << 1) | 1;
+
+   memset (index + 1, 0, (mask + 1) * sizeof (*index));
+
+   for (i = 0; i < object->u.object.length; ++ i)
+   {
+      slot = object->u.object.values [i].name_hash & mask;
+
+      while (index [1 + slot])
+         slot = (slot + 1) & mask;
+
+      index [1 + slot] = i + 1;
+   }
+
+   index [0] = mask;
+}
+
+json_value * json_object_get (const json_value * object,
+                              const json_char * name,
+                              unsigned int name_length,
+                              unsigned int hash)
+{
+   const json_object_entry * entry;
+   unsigned short * index;
+   unsigned int i;
+
+   if (object->type != json_object)
+      return 0;
+
+   if ((index = (unsigned short *) object->_reserved.object_mem))
+   {
+      if (!index [0])
+         index_build (object, index);
+
+      for (i = hash & index [0]; index [1 + i]; i = (i + 1) & index [0])
+      {
+         entry = &object->u.object.values [index [1 + i] - 1];
+
+         if (entry->name_hash == hash && entry->name_length == name_length
+               && !memcmp (entry->name, name, name_length))
+         {
+            return entry->value;
+         }
+      }
+
+      return 0;
    }
+
+   for (i = 0; i < object->u.object.length; ++ i)
+   {
+      entry = &object->u.object.values [i];
+
+      if (entry->name_hash == hash && entry->name_length == name_length
+            && !memcmp (entry->name, name, name_length))
+      {
+         return entry->value;
+      }
+   }
+
+   return 0;
 }
 
 void json_value_free (json_value * value)
@@ -1009,3 +1963,213 @@ void json_value_free (json_value * value)
    json_value_free_ex (&settings, value);
 }
 
+/* Pull reader
+ *
+ * Walks a document without building it: containers are entered one level at
+ * a time and their elements either skipped or handed back as the extent of
+ * their source, to be parsed separately.  Only structure is checked here;
+ * whatever is skipped is validated when (and if) it is parsed.
+ */
+
+static void reader_skip_ws (json_reader * reader)
+{
+   if (reader->ptr < reader->end && is_ws (*reader->ptr)
+         && ++ reader->ptr < reader->end && is_ws (*reader->ptr))
+   {
+      reader->ptr = scan_ws (reader->ptr, reader->end);
+   }
+}
+
+/* Advance past the string starting at the opening quote; 0 if unterminated
+ */
+static int reader_skip_string (json_reader * reader)
+{
+   const json_char * p = reader->ptr + 1;
+
+   while ((p = scan_string (p, reader->end)) < reader->end)
+   {
+      if (*p == '"')
+      {
+         reader->ptr = p + 1;
+         return 1;
+      }
+
+      if (*p ++ == '\\' && p ++ == reader->end)
+         break;
+   }
+
+   return 0;
+}
+
+void json_reader_init (json_reader * reader, const json_char * json, size_t length)
+{
+   memset (reader, 0, sizeof (*reader));
+
+   reader->ptr = json;
+   reader->end = json + length;
+}
+
+int json_reader_enter (json_reader * reader, json_type type)
+{
+   reader_skip_ws (reader);
+
+   if (reader->ptr == reader->end
+         || reader->depth == sizeof (reader->objects) * 8
+         || *reader->ptr != (type == json_object ? '{' : '['))
+   {
+      return 0;
+   }
+
+   ++ reader->ptr;
+
+   if (type == json_object)
+      reader->objects |= 1UL << reader->depth;
+   else
+      reader->objects &= ~ (1UL << reader->depth);
+
+   ++ reader->depth;
+   reader->first = 1;
+
+   return 1;
+}
+
+int json_reader_next (json_reader * reader,
+                      const json_char ** name, unsigned int * name_length)
+{
+   const json_char * start;
+   int object;
+
+   if (!reader->depth)
+      return -1;
+
+   object = (reader->objects >> (reader->depth - 1)) & 1;
+
+   reader_skip_ws (reader);
+
+   if (reader->ptr == reader->end)
+      return -1;
+
+   if (*reader->ptr == (object ? '}' : ']'))
+   {
+      ++ reader->ptr;
+      -- reader->depth;
+      reader->first = 0;
+
+      return 0;
+   }
+
+   if (!reader->first)
+   {
+      if (*reader->ptr != ',')
+         return -1;
+
+      ++ reader->ptr;
+      reader_skip_ws (reader);
+   }
+
+   reader->first = 0;
+
+   if (!object)
+      return 1;
+
+   if (reader->ptr == reader->end || *reader->ptr != '"')
+      return -1;
+
+   start = reader->ptr + 1;
+
+   if (!reader_skip_string (reader))
+      return -1;
+
+   if (name)
+      *name = start;
+
+   if (name_length)
+      *name_length = reader->ptr - 1 - start;
+
+   reader_skip_ws (reader);
+
+   if (reader->ptr == reader->end || *reader->ptr != ':')
+      return -1;
+
+   ++ reader->ptr;
+
+   return 1;
+}
+
+int json_reader_skip (json_reader * reader,
+                      const json_char ** value, size_t * length)
+{
+   const json_char * start;
+   unsigned int depth = 0;
+   json_char c;
+
+   reader_skip_ws (reader);
+   start = reader->ptr;
+
+   if (reader->ptr == reader->end)
+      return 0;
+
+   switch (*reader->ptr)
+   {
+      case '"':
+
+         if (!reader_skip_string (reader))
+            return 0;
+
+         break;
+
+      case '{':
+      case '[':
+
+         for (;;)
+         {
+            if (reader->ptr == reader->end)
+               return 0;
+
+            if ((c = *reader->ptr) == '"')
+            {
+               if (!reader_skip_string (reader))
+                  return 0;
+
+               continue;
+            }
+
+            ++ reader->ptr;
+
+            if (c == '{' || c == '[')
+               ++ depth;
+            else if ((c == '}' || c == ']') && !-- depth)
+               break;
+         }
+
+         break;
+
+      default:
+
+         while (reader->ptr < reader->end && !is_ws (*reader->ptr)
+                  && *reader->ptr != ',' && *reader->ptr != '}' && *reader->ptr != ']')
+         {
+            ++ reader->ptr;
+         }
+
+         if (reader->ptr == start)
+            return 0;
+
+         break;
+   };
+
+   if (value)
+      *value = start;
+
+   if (length)
+      *length = reader->ptr - start;
+
+   return 1;
+}
+
+int json_reader_done (json_reader * reader)
+{
+   reader_skip_ws (reader);
+
+   return !reader->depth && reader->ptr == reader->end;
+}
@@ -74,6 +74,16 @@ typedef struct
 
 #define json_enable_comments  0x01
 
+/* Parse in place: the source buffer is modified (strings are unescaped into
+ * it) and must outlive the result, which must be freed with
+ * json_value_free_ex using the same settings.
+ */
+#define json_in_situ          0x02
+
+/* Give large objects a lookup index for json_object_get, built on first use
+ */
+#define json_index_objects    0x04
+
 typedef enum
 {
    json_none,
@@ -93,6 +103,7 @@ typedef struct _json_object_entry
 {
     json_char * name;
     unsigned int name_length;
+    unsigned int name_hash;  /* json_hash (name, name_length) */
     
     struct _json_value * value;
     
@@ -266,6 +277,16 @@ json_value * json_parse_ex (json_settings * settings,
 
 void json_value_free (json_value *);
 
+unsigned int json_hash (const json_char * name, unsigned int length);
+
+/* Look up a member of an object by name and json_hash of the name, returning
+ * the first match or 0.
+ */
+json_value * json_object_get (const json_value * object,
+                              const json_char * name,
+                              unsigned int name_length,
+                              unsigned int hash);
+
 
 /* Not usually necessary, unless you used a custom mem_alloc and now want to
  * use a custom mem_free.
@@ -274,6 +295,42 @@ void json_value_free_ex (json_settings * settings,
                          json_value *);
 
 
+/* Pull reader: walks a document one container level at a time without
+ * building it, e.g. to parse the elements of a large array one by one.
+ * Comments are not supported.
+ */
+typedef struct
+{
+   const json_char * ptr, * end;
+
+   unsigned int depth;  /* containers entered and not yet left */
+   unsigned long objects;  /* bit n set if container n is an object */
+   int first;
+
+} json_reader;
+
+void json_reader_init (json_reader *, const json_char * json, size_t length);
+
+/* Enter the object or array (as given by type) at the current position;
+ * 0 (consuming nothing) if the next value is something else.
+ */
+int json_reader_enter (json_reader *, json_type type);
+
+/* Move to the next element of the current container: 1 if there is one
+ * (for objects, name is set to its raw, still escaped, name), 0 after
+ * leaving the container at its end, or -1 on a syntax error.
+ */
+int json_reader_next (json_reader *, const json_char ** name,
+                      unsigned int * name_length);
+
+/* Skip the value at the current position, returning its source extent
+ */
+int json_reader_skip (json_reader *, const json_char ** value, size_t * length);
+
+/* 1 if all containers have been left and only whitespace remains
+ */
+int json_reader_done (json_reader *);
+
 #ifdef __cplusplus
    } /* extern "C" */
 #endif
@@ -0,0 +1,672 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <debug.h>
+#include <eventloop.h>
+#include <proxy.h>
+#include <sslconn.h>
+#include <util.h>
+
+#include "purple-http-pool.h"
+
+/* largest response header block we accept */
+#define HTTP_MAX_HEADERS 65536
+#define HTTP_READ_SIZE 16384
+
+typedef struct _PurpleHttpPoolHost PurpleHttpPoolHost;
+typedef struct _PurpleHttpPoolConn PurpleHttpPoolConn;
+
+struct _PurpleHttpPool {
+	PurpleAccount *account;
+	guint max_conns; /* per host */
+	guint idle_secs;
+	GHashTable *hosts; /* char *"host:port[s]" -> PurpleHttpPoolHost */
+	PurpleHttpPoolStats stats;
+};
+
+struct _PurpleHttpPoolHost {
+	PurpleHttpPool *pool;
+	char *host;
+	int port;
+	gboolean ssl;
+	GQueue queue; /* PurpleHttpPoolRequest waiting for a connection */
+	GList *conns; /* PurpleHttpPoolConn */
+};
+
+struct _PurpleHttpPoolRequest {
+	PurpleHttpPoolHost *host;
+	PurpleHttpPoolConn *conn; /* once sent */
+	GString *request; /* headers and body, ready to write */
+	char *headers; /* of the response, once read */
+	gsize max_len;
+	gboolean retried;
+	PurpleHttpPoolCallback callback;
+	gpointer user_data;
+};
+
+struct _PurpleHttpPoolConn {
+	PurpleHttpPoolHost *host;
+	PurpleProxyConnectData *connection;
+	PurpleSslConnection *ssl_connection;
+	int fd;
+	guint inpa; /* read watcher (unless ssl) */
+	guint outpa; /* write watcher, while sending */
+	guint timer; /* idle timeout, or deferred connect failure */
+	gboolean connected;
+	gboolean connecting; /* inside purple_ssl_connect, which can fail before returning */
+	unsigned used; /* responses completed */
+
+	PurpleHttpPoolRequest *req; /* in progress */
+	gsize sent; /* bytes of req->request written */
+
+	/* response */
+	GString *in; /* as read */
+	gsize body_off; /* start of the body in in, 0 until the headers are in */
+	int status;
+	gssize content_length; /* -1 if not given */
+	gboolean chunked;
+	gboolean close; /* server won't keep the connection open */
+	gboolean eof;
+	GString *body; /* decoded, if chunked */
+	gsize chunk_off; /* next chunk header in in */
+};
+
+static void host_dispatch(PurpleHttpPoolHost *host);
+
+static void request_free(PurpleHttpPoolRequest *req) {
+	g_string_free(req->request, TRUE);
+	g_free(req->headers);
+	g_free(req);
+}
+
+static void request_fail(PurpleHttpPoolRequest *req, const char *error) {
+	req->host->pool->stats.failed ++;
+	req->callback(req, req->user_data, 0, NULL, 0, error);
+	request_free(req);
+}
+
+static void conn_close(PurpleHttpPoolConn *conn) {
+	PurpleHttpPoolHost *host = conn->host;
+
+	host->conns = g_list_remove(host->conns, conn);
+	host->pool->stats.conns --;
+
+	if (conn->timer > 0)
+		purple_timeout_remove(conn->timer);
+	if (conn->inpa > 0)
+		purple_input_remove(conn->inpa);
+	if (conn->outpa > 0)
+		purple_input_remove(conn->outpa);
+	if (conn->connection)
+		purple_proxy_connect_cancel(conn->connection);
+	if (conn->ssl_connection)
+		purple_ssl_close(conn->ssl_connection);
+	else if (conn->fd >= 0)
+		close(conn->fd);
+
+	g_string_free(conn->in, TRUE);
+	g_string_free(conn->body, TRUE);
+	g_free(conn);
+}
+
+static void conn_reset(PurpleHttpPoolConn *conn) {
+	g_string_truncate(conn->in, 0);
+	g_string_truncate(conn->body, 0);
+	conn->body_off = 0;
+	conn->status = 0;
+	conn->content_length = -1;
+	conn->chunked = FALSE;
+	conn->close = FALSE;
+	conn->chunk_off = 0;
+}
+
+static gboolean host_connected(PurpleHttpPoolHost *host) {
+	GList *l;
+	for (l = host->conns; l; l = l->next)
+		if (((PurpleHttpPoolConn *)l->data)->connected)
+			return TRUE;
+	return FALSE;
+}
+
+static void conn_error(PurpleHttpPoolConn *conn, const char *error) {
+	PurpleHttpPoolHost *host = conn->host;
+	PurpleHttpPoolRequest *req = conn->req;
+
+	purple_debug_warning("http", "%s:%d: %s\n", host->host, host->port, error);
+
+	/* A kept-alive connection may have been closed by the server just as we
+	 * sent on it: if nothing came back, try again on a fresh one. */
+	gboolean retry = req && conn->used && !conn->in->len && !req->retried;
+	gboolean connected = conn->connected;
+	conn_close(conn);
+
+	if (req) {
+		req->conn = NULL;
+		if (retry) {
+			req->retried = TRUE;
+			host->pool->stats.retried ++;
+			host->pool->stats.queued ++;
+			g_queue_push_head(&host->queue, req);
+		} else
+			request_fail(req, error);
+	} else if (!connected && !host_connected(host)) {
+		/* couldn't connect, and nothing else is serving the queue */
+		GQueue queue = host->queue;
+		g_queue_init(&host->queue);
+		host->pool->stats.queued -= queue.length;
+		while ((req = g_queue_pop_head(&queue)))
+			request_fail(req, error);
+	}
+
+	host_dispatch(host);
+}
+
+static gboolean conn_idle_cb(gpointer data) {
+	PurpleHttpPoolConn *conn = data;
+	conn->timer = 0;
+	conn_close(conn);
+	return FALSE;
+}
+
+static gboolean conn_connect_failed_cb(gpointer data) {
+	PurpleHttpPoolConn *conn = data;
+	conn->timer = 0;
+	conn_error(conn, "Unable to connect");
+	return FALSE;
+}
+
+/* Hand the response to the request's callback, and put the connection back
+ * to use (or close it). */
+static void conn_done(PurpleHttpPoolConn *conn) {
+	PurpleHttpPoolHost *host = conn->host;
+	PurpleHttpPoolRequest *req = conn->req;
+	GString *resp;
+	const gchar *body;
+	gsize len;
+
+	/* take the response buffer, so the connection can be reused by the callback */
+	if (conn->chunked) {
+		resp = conn->body;
+		conn->body = g_string_new(NULL);
+		body = resp->str;
+		len = resp->len;
+	} else {
+		resp = conn->in;
+		conn->in = g_string_new(NULL);
+		body = resp->str + conn->body_off;
+		len = resp->len - conn->body_off;
+		if (conn->content_length >= 0 && len > (gsize)conn->content_length) {
+			/* we never pipeline, so anything more is garbage */
+			conn->close = TRUE;
+			len = conn->content_length;
+			resp->str[conn->body_off + len] = '\0';
+		}
+	}
+
+	int status = conn->status;
+	gboolean keep = !conn->close && !conn->eof;
+	conn->req = NULL;
+	req->conn = NULL;
+	conn->used ++;
+	conn_reset(conn);
+
+	if (keep) {
+		if (host->pool->idle_secs)
+			conn->timer = purple_timeout_add_seconds(host->pool->idle_secs, conn_idle_cb, conn);
+	} else
+		conn_close(conn);
+
+	req->callback(req, req->user_data, status, body, len, NULL);
+	request_free(req);
+	g_string_free(resp, TRUE);
+
+	host_dispatch(host);
+}
+
+static gboolean conn_read_headers(PurpleHttpPoolConn *conn) {
+	char *resp = conn->in->str;
+	char *eoh = g_strstr_len(resp, conn->in->len, "\r\n\r\n");
+	if (!eoh) {
+		if (conn->in->len > HTTP_MAX_HEADERS) {
+			conn_error(conn, "Response headers too long");
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+	int major, minor, status;
+	if (sscanf(resp, "HTTP/%d.%d %d", &major, &minor, &status) != 3) {
+		conn_error(conn, "Invalid HTTP response");
+		return FALSE;
+	}
+
+	if (status / 100 == 1) {
+		/* 100 Continue and such: the real response follows */
+		g_string_erase(conn->in, 0, eoh + 4 - resp);
+		return conn_read_headers(conn);
+	}
+
+	conn->status = status;
+	conn->close = major < 1 || (major == 1 && minor == 0);
+	conn->content_length = -1;
+
+	g_free(conn->req->headers);
+	conn->req->headers = g_strndup(resp, eoh + 2 - resp);
+	*eoh = '\0';
+	char *line = strstr(resp, "\r\n");
+	while (line) {
+		line += 2;
+		char *next = strstr(line, "\r\n");
+		if (next)
+			*next = '\0';
+		char *val = strchr(line, ':');
+		if (val) {
+			*val++ = '\0';
+			while (*val == ' ' || *val == '\t')
+				val++;
+			if (!g_ascii_strcasecmp(line, "Content-Length"))
+				conn->content_length = g_ascii_strtoll(val, NULL, 10);
+			else if (!g_ascii_strcasecmp(line, "Transfer-Encoding"))
+				conn->chunked = !!purple_strcasestr(val, "chunked");
+			else if (!g_ascii_strcasecmp(line, "Connection")) {
+				if (purple_strcasestr(val, "close"))
+					conn->close = TRUE;
+				else if (purple_strcasestr(val, "keep-alive"))
+					conn->close = FALSE;
+			}
+		}
+		line = next;
+	}
+
+	conn->body_off = conn->chunk_off = eoh + 4 - resp;
+	if (conn->status == 204 || conn->status == 304) {
+		conn->chunked = FALSE;
+		conn->content_length = 0;
+	} else if (conn->chunked)
+		conn->content_length = -1;
+	else if (conn->content_length < 0)
+		/* body runs to the end of the connection */
+		conn->close = TRUE;
+
+	if (conn->content_length > 0 && (gsize)conn->content_length > conn->req->max_len) {
+		conn_error(conn, "Response too large");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* Decode whatever complete chunks have arrived, setting done once the last
+ * has.  Returns an error for a malformed or oversized chunk. */
+static const char *conn_read_chunks(PurpleHttpPoolConn *conn, gboolean *done) {
+	*done = FALSE;
+	for (;;) {
+		const char *p = conn->in->str + conn->chunk_off;
+		gsize avail = conn->in->len - conn->chunk_off;
+		const char *eol = g_strstr_len(p, avail, "\r\n");
+		if (!eol)
+			return NULL;
+
+		gchar *end;
+		guint64 size = g_ascii_strtoull(p, &end, 16);
+		if (!g_ascii_isxdigit(*p) || (*end != ';' && *end != '\r'))
+			return "Invalid chunk size";
+		gsize line = eol + 2 - p;
+		if (!size) {
+			/* last chunk: skip any trailers, up to an empty line */
+			p += line;
+			avail -= line;
+			*done = (avail >= 2 && p[0] == '\r' && p[1] == '\n') ||
+				g_strstr_len(p, avail, "\r\n\r\n");
+			return NULL;
+		}
+
+		/* (body->len never exceeds max_len, so neither can this overflow below) */
+		if (size > conn->req->max_len - conn->body->len)
+			return "Response too large";
+		if (avail < line + size + 2)
+			return NULL;
+		g_string_append_len(conn->body, p + line, size);
+		conn->chunk_off += line + size + 2;
+	}
+}
+
+static void conn_parse(PurpleHttpPoolConn *conn) {
+	if (!conn->body_off) {
+		if (!conn_read_headers(conn))
+			return;
+		if (!conn->body_off) {
+			if (conn->eof)
+				conn_error(conn, "Connection closed");
+			return;
+		}
+	}
+
+	gboolean done;
+	gsize len;
+	if (conn->chunked) {
+		const char *error = conn_read_chunks(conn, &done);
+		if (error) {
+			conn_error(conn, error);
+			return;
+		}
+		/* bounds what's buffered while a chunk is still arriving, too */
+		len = conn->in->len - conn->body_off;
+	} else {
+		len = conn->in->len - conn->body_off;
+		done = conn->content_length >= 0
+			? len >= (gsize)conn->content_length
+			: conn->eof;
+	}
+
+	if (len > conn->req->max_len)
+		conn_error(conn, "Response too large");
+	else if (done)
+		conn_done(conn);
+	else if (conn->eof)
+		conn_error(conn, "Connection closed");
+}
+
+static void conn_input_cb(gpointer data, G_GNUC_UNUSED gint source, G_GNUC_UNUSED PurpleInputCondition cond) {
+	PurpleHttpPoolConn *conn = data;
+	gsize got = 0;
+
+	for (;;) {
+		gsize off = conn->in->len;
+		g_string_set_size(conn->in, off + HTTP_READ_SIZE);
+		ssize_t len = conn->ssl_connection
+			? (ssize_t)purple_ssl_read(conn->ssl_connection, conn->in->str + off, HTTP_READ_SIZE)
+			: read(conn->fd, conn->in->str + off, HTTP_READ_SIZE);
+		g_string_set_size(conn->in, off + MAX(len, 0));
+
+		if (len < 0) {
+			if (errno == EAGAIN)
+				break;
+			conn_error(conn, g_strerror(errno));
+			return;
+		}
+		if (len == 0) {
+			conn->eof = TRUE;
+			break;
+		}
+		got += len;
+	}
+	conn->host->pool->stats.bytes_in += got;
+
+	if (!conn->req) {
+		/* closed (or garbage) while idle */
+		PurpleHttpPoolHost *host = conn->host;
+		conn_close(conn);
+		host_dispatch(host);
+		return;
+	}
+
+	conn_parse(conn);
+}
+
+static void conn_write_cb(gpointer data, G_GNUC_UNUSED gint source, G_GNUC_UNUSED PurpleInputCondition cond) {
+	PurpleHttpPoolConn *conn = data;
+	GString *request = conn->req->request;
+
+	ssize_t len = conn->ssl_connection
+		? (ssize_t)purple_ssl_write(conn->ssl_connection, request->str + conn->sent, request->len - conn->sent)
+		: write(conn->fd, request->str + conn->sent, request->len - conn->sent);
+
+	if (len < 0) {
+		if (errno != EAGAIN)
+			conn_error(conn, g_strerror(errno));
+		return;
+	}
+
+	conn->sent += len;
+	if (conn->sent >= request->len) {
+		purple_input_remove(conn->outpa);
+		conn->outpa = 0;
+	}
+}
+
+/* Start sending req on an idle connection.  Nothing is written until the
+ * main loop runs, so this can't fail (or call back) under the caller. */
+static void conn_send(PurpleHttpPoolConn *conn, PurpleHttpPoolRequest *req) {
+	PurpleHttpPool *pool = conn->host->pool;
+
+	if (conn->timer > 0) {
+		purple_timeout_remove(conn->timer);
+		conn->timer = 0;
+	}
+	if (conn->used)
+		pool->stats.reused ++;
+
+	conn->req = req;
+	req->conn = conn;
+	conn->sent = 0;
+	conn->outpa = purple_input_add(conn->fd, PURPLE_INPUT_WRITE, conn_write_cb, conn);
+}
+
+static void conn_ssl_input_cb(gpointer data, G_GNUC_UNUSED PurpleSslConnection *ssl_connection, PurpleInputCondition cond) {
+	PurpleHttpPoolConn *conn = data;
+	conn_input_cb(data, conn->fd, cond);
+}
+
+static void conn_ssl_connect_cb(gpointer data, PurpleSslConnection *ssl_connection, G_GNUC_UNUSED PurpleInputCondition cond) {
+	PurpleHttpPoolConn *conn = data;
+
+	conn->fd = ssl_connection->fd;
+	conn->connected = TRUE;
+	purple_ssl_input_add(conn->ssl_connection, conn_ssl_input_cb, conn);
+	host_dispatch(conn->host);
+}
+
+static void conn_ssl_error_cb(G_GNUC_UNUSED PurpleSslConnection *ssl_connection, PurpleSslErrorType error, gpointer data) {
+	PurpleHttpPoolConn *conn = data;
+	conn->ssl_connection = NULL;
+	/* left for conn_new to report from the main loop */
+	if (conn->connecting)
+		return;
+	conn_error(conn, purple_ssl_strerror(error));
+}
+
+static void conn_connect_cb(gpointer data, gint source, const gchar *error_message) {
+	PurpleHttpPoolConn *conn = data;
+	conn->connection = NULL;
+
+	if (source == -1) {
+		conn_error(conn, error_message ?: "Unable to connect");
+		return;
+	}
+
+	conn->fd = source;
+	conn->connected = TRUE;
+	conn->inpa = purple_input_add(conn->fd, PURPLE_INPUT_READ, conn_input_cb, conn);
+	host_dispatch(conn->host);
+}
+
+static void conn_new(PurpleHttpPoolHost *host) {
+	PurpleHttpPool *pool = host->pool;
+	PurpleHttpPoolConn *conn = g_new0(PurpleHttpPoolConn, 1);
+
+	conn->host = host;
+	conn->fd = -1;
+	conn->in = g_string_sized_new(HTTP_READ_SIZE);
+	conn->body = g_string_new(NULL);
+	conn_reset(conn);
+	host->conns = g_list_prepend(host->conns, conn);
+	pool->stats.conns ++;
+	pool->stats.connects ++;
+
+	purple_debug_misc("http", "connecting to %s:%d (%u open)\n", host->host, host->port, pool->stats.conns);
+	if (host->ssl) {
+		conn->connecting = TRUE;
+		conn->ssl_connection = purple_ssl_connect(pool->account, host->host, host->port,
+				conn_ssl_connect_cb, conn_ssl_error_cb, conn);
+		conn->connecting = FALSE;
+	} else
+		conn->connection = purple_proxy_connect(NULL, pool->account, host->host, host->port,
+				conn_connect_cb, conn);
+
+	/* report the failure from the main loop, like any other */
+	if (!(conn->ssl_connection || conn->connection))
+		conn->timer = purple_timeout_add(0, conn_connect_failed_cb, conn);
+}
+
+/* Send queued requests on idle connections, and open more (up to the cap)
+ * for those left over. */
+static void host_dispatch(PurpleHttpPoolHost *host) {
+	PurpleHttpPool *pool = host->pool;
+	guint connecting = 0, count = 0;
+	GList *l;
+
+	for (l = host->conns; l; l = l->next) {
+		PurpleHttpPoolConn *conn = l->data;
+		count ++;
+		if (!conn->connected)
+			connecting ++;
+		else if (!conn->req && !g_queue_is_empty(&host->queue)) {
+			pool->stats.queued --;
+			conn_send(conn, g_queue_pop_head(&host->queue));
+		}
+	}
+
+	while (g_queue_get_length(&host->queue) > connecting && count < pool->max_conns) {
+		conn_new(host);
+		connecting ++;
+		count ++;
+	}
+}
+
+static void host_free(gpointer data) {
+	PurpleHttpPoolHost *host = data;
+	PurpleHttpPoolRequest *req;
+
+	while (host->conns) {
+		PurpleHttpPoolConn *conn = host->conns->data;
+		if (conn->req)
+			request_free(conn->req);
+		conn_close(conn);
+	}
+	while ((req = g_queue_pop_head(&host->queue)))
+		request_free(req);
+
+	g_free(host->host);
+	g_free(host);
+}
+
+PurpleHttpPool *purple_http_pool_new(PurpleAccount *account, guint max_conns, guint idle_secs) {
+	PurpleHttpPool *pool = g_new0(PurpleHttpPool, 1);
+	pool->account = account;
+	pool->max_conns = MAX(max_conns, 1);
+	pool->idle_secs = idle_secs;
+	pool->hosts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, host_free);
+	return pool;
+}
+
+void purple_http_pool_destroy(PurpleHttpPool *pool) {
+	g_hash_table_destroy(pool->hosts);
+	g_free(pool);
+}
+
+PurpleHttpPoolRequest *purple_http_pool_request(PurpleHttpPool *pool,
+		const char *method, const char *url, const char *headers,
+		const char *body, gsize body_len, gsize max_len,
+		PurpleHttpPoolCallback callback, gpointer user_data) {
+	gboolean ssl;
+
+	if (!g_ascii_strncasecmp(url, "http://", 7)) {
+		ssl = FALSE;
+		url += 7;
+	}
+	else if (!g_ascii_strncasecmp(url, "https://", 8)) {
+		ssl = TRUE;
+		url += 8;
+	}
+	else
+		return NULL;
+
+	char *hostname, *path;
+	int port;
+	if (!purple_url_parse(url, &hostname, &port, &path, NULL, NULL))
+		return NULL;
+	/* hack to fix default port */
+	if (ssl && port == 80)
+		port = 443;
+
+	char *key = g_strdup_printf("%s:%d%s", hostname, port, ssl ? "s" : "");
+	PurpleHttpPoolHost *host = g_hash_table_lookup(pool->hosts, key);
+	if (!host) {
+		host = g_new0(PurpleHttpPoolHost, 1);
+		host->pool = pool;
+		host->host = g_strdup(hostname);
+		host->port = port;
+		host->ssl = ssl;
+		g_queue_init(&host->queue);
+		g_hash_table_insert(pool->hosts, key, host);
+	} else
+		g_free(key);
+
+	PurpleHttpPoolRequest *req = g_new0(PurpleHttpPoolRequest, 1);
+	req->host = host;
+	req->max_len = max_len;
+	req->callback = callback;
+	req->user_data = user_data;
+
+	req->request = g_string_sized_new(256 + strlen(path) + (headers ? strlen(headers) : 0) + body_len);
+	g_string_printf(req->request, "\
+%s /%s HTTP/1.1\r\n\
+Host: %s\r\n\
+Connection: keep-alive\r\n\
+Accept: */*\r\n", method, path, hostname);
+	if (headers)
+		g_string_append(req->request, headers);
+	if (body || strcmp(method, "GET"))
+		g_string_append_printf(req->request, "Content-Length: %" G_GSIZE_FORMAT "\r\n", body_len);
+	g_string_append(req->request, "\r\n");
+	if (body)
+		g_string_append_len(req->request, body, body_len);
+
+	g_free(hostname);
+	g_free(path);
+
+	g_queue_push_tail(&host->queue, req);
+	pool->stats.queued ++;
+	pool->stats.requests ++;
+	host_dispatch(host);
+	return req;
+}
+
+char *purple_http_pool_get_header(PurpleHttpPoolRequest *req, const char *name) {
+	size_t name_len = strlen(name);
+	const char *line = req->headers ? strstr(req->headers, "\r\n") : NULL;
+
+	while (line) {
+		line += 2;
+		const char *end = strstr(line, "\r\n");
+		if (!end)
+			break;
+		if (!g_ascii_strncasecmp(line, name, name_len) && line[name_len] == ':') {
+			const char *val = line + name_len + 1;
+			while (*val == ' ' || *val == '\t')
+				val++;
+			return g_strndup(val, end - val);
+		}
+		line = end;
+	}
+	return NULL;
+}
+
+void purple_http_pool_cancel(PurpleHttpPoolRequest *req) {
+	PurpleHttpPoolHost *host = req->host;
+
+	if (req->conn) {
+		/* the response is on its way: the connection can't be reused */
+		req->conn->req = NULL;
+		conn_close(req->conn);
+		host_dispatch(host);
+	} else if (g_queue_remove(&host->queue, req))
+		host->pool->stats.queued --;
+	request_free(req);
+}
+
+const PurpleHttpPoolStats *purple_http_pool_get_stats(PurpleHttpPool *pool) {
+	return &pool->stats;
+}
@@ -0,0 +1,46 @@
+#ifndef _PURPLE_HTTP_POOL_H_
+#define _PURPLE_HTTP_POOL_H_
+
+#include <glib.h>
+#include <account.h>
+
+/* Persistent HTTP/1.1 connections, kept open between requests and shared
+ * by all requests to the same host (and port and scheme). */
+typedef struct _PurpleHttpPool PurpleHttpPool;
+typedef struct _PurpleHttpPoolRequest PurpleHttpPoolRequest;
+
+typedef struct _PurpleHttpPoolStats {
+	guint64 requests; /* requests made */
+	guint64 connects; /* connections opened */
+	guint64 reused; /* requests sent on a connection that had already served one */
+	guint64 retried; /* requests resent after a kept-alive connection closed under them */
+	guint64 failed; /* requests that got an error */
+	guint64 bytes_in; /* response bytes read, including headers */
+	guint queued; /* requests waiting for a connection */
+	guint conns; /* connections open (or opening) */
+} PurpleHttpPoolStats;
+
+/* On success, status is the HTTP status, and body (always followed by a NUL)
+ * the response body, with any chunked encoding removed.  On failure, error
+ * is set (and status is 0).  The body belongs to the pool. */
+typedef void (*PurpleHttpPoolCallback)(PurpleHttpPoolRequest *req, gpointer user_data, int status, const gchar *body, gsize len, const gchar *error);
+
+/* Open at most max_conns connections to each host, closing them after
+ * idle_secs without a request. */
+PurpleHttpPool *purple_http_pool_new(PurpleAccount *account, guint max_conns, guint idle_secs);
+/* Close all connections, and drop all pending requests without calling back. */
+void purple_http_pool_destroy(PurpleHttpPool *pool);
+/* Queue a request for an http:// or https:// url, with optional extra
+ * headers (each ending in "\r\n") and body, to be sent on an idle
+ * connection to its host, or a new one if there is none and the cap allows,
+ * or else once one is free.  Responses larger than max_len bytes fail.
+ * The callback is never called before this returns.  Returns NULL if the
+ * url can't be handled. */
+PurpleHttpPoolRequest *purple_http_pool_request(PurpleHttpPool *pool, const char *method, const char *url, const char *headers, const char *body, gsize body_len, gsize max_len, PurpleHttpPoolCallback callback, gpointer user_data);
+/* The value of a response header (to be g_free'd), or NULL; only from the callback. */
+char *purple_http_pool_get_header(PurpleHttpPoolRequest *req, const char *name);
+/* Drop a pending request without calling back. */
+void purple_http_pool_cancel(PurpleHttpPoolRequest *req);
+const PurpleHttpPoolStats *purple_http_pool_get_stats(PurpleHttpPool *pool);
+
+#endif
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <zlib.h>
 
 #include <cipher.h>
 #include <debug.h>
@@ -23,10 +24,20 @@ static const char WS_SALT[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 #define WS_OP_PING 0x09
 #define WS_OP_PONG 0x0A
 #define WS_MASK	0x80
-#define MAX_FRAG 64
+/* largest frame header we send: 2 + 8 (length) + 4 (mask) */
+#define WS_MAX_HEADER 14
+/* default buffer policy (see purple_websocket_set_buffer_policy) */
+#define WS_BUFFER_TARGET 16384
+#define WS_BUFFER_IDLE 60
+/* default bytes read per wakeup (see purple_websocket_set_read_limit) */
+#define WS_READ_LIMIT (256 * 1024)
+/* appended by Z_SYNC_FLUSH, and left off the wire by permessage-deflate */
+static const guchar WS_DEFLATE_TAIL[4] = { 0x00, 0x00, 0xff, 0xff };
 
 struct buffer {
+	PurpleWebsocket *ws; /* owner, for accounting */
 	guchar *buf;
+	gsize rd; /* next byte to consume (input only) */
 	gsize off; /* next byte to read/write to */
 	gsize len; /* (expected) size of data in buffer */
 	gsize siz; /* allocated size of buffer */
@@ -35,6 +46,7 @@ struct buffer {
 struct _PurpleWebsocket {
 	PurpleWebsocketCallback callback;
 	void *user_data;
+	PurpleWebsocketFlags flags;
 
 	char *key;
 
@@ -42,19 +54,68 @@ struct _PurpleWebsocket {
 	PurpleSslConnection *ssl_connection;
 
 	int fd;
-	guint inpa;
+	guint inpa; /* read watcher (unless ssl) */
+	guint outpa; /* write watcher, while output is backed up */
+	guint flush; /* idle flush of queued frames */
 
 	struct buffer input, output;
 
+	/* fragments of the current message so far (inflated) */
+	struct buffer message;
+	uint8_t message_op; /* (0 if none) */
+	gboolean message_deflated;
+
+	/* permessage-deflate, if negotiated */
+	gboolean deflate;
+	z_stream zin, zout;
+	gboolean zin_reset, zout_reset; /* no_context_takeover */
+	int zout_bits; /* window size for sending (0 if we cannot compress) */
+	gboolean zout_init;
+	struct buffer deflated; /* compressed payload being sent */
+
+	/* buffers grow in powers of two, and are shrunk back to buffer_target
+	 * once none has had to grow past it for buffer_idle seconds */
+	gsize buffer_target;
+	guint buffer_idle;
+	gint64 grown; /* last time a buffer grew past the target */
+	guint shrink; /* timer, while any buffer is oversized */
+
+	gsize read_limit; /* bytes to read per wakeup before yielding (0 for no limit) */
+	guint drain; /* timer to carry on reading after yielding */
+
+	PurpleWebsocketStats stats;
+
 	gboolean connected;
 	PurpleInputCondition closed;
 };
 
-static void buffer_set_len(struct buffer *b, size_t n) {
-	if (n > b->siz) {
-		b->buf = g_realloc(b->buf, n);
-		b->siz = n;
+static gboolean ws_shrink_cb(gpointer data);
+
+/* reallocate to exactly siz bytes */
+static void buffer_resize(struct buffer *b, gsize siz) {
+	PurpleWebsocketStats *stats = &b->ws->stats;
+	b->buf = g_realloc(b->buf, siz);
+	stats->buffer_size += siz - b->siz;
+	b->siz = siz;
+	if (stats->buffer_size > stats->buffer_peak)
+		stats->buffer_peak = stats->buffer_size;
+}
+
+/* grow to the next power of two that holds n bytes */
+static void buffer_grow(struct buffer *b, gsize n) {
+	PurpleWebsocket *ws = b->ws;
+	buffer_resize(b, MAX((gsize)1 << g_bit_storage(n - 1), 256));
+	ws->stats.buffer_grows ++;
+	if (b->siz > ws->buffer_target) {
+		ws->grown = g_get_monotonic_time();
+		if (!ws->shrink && ws->buffer_idle)
+			ws->shrink = purple_timeout_add_seconds(ws->buffer_idle, ws_shrink_cb, ws);
 	}
+}
+
+static void buffer_set_len(struct buffer *b, size_t n) {
+	if (n > b->siz)
+		buffer_grow(b, n);
 	b->len = n;
 }
 
@@ -66,6 +127,58 @@ static inline guchar *buffer_incr(struct buffer *b, size_t n) {
 
 #define BUFFER_ADD(B, T, V) (*(T*)buffer_incr((B), sizeof(T)) = (V))
 
+/* make room for at least n more bytes after len, growing geometrically */
+static guchar *buffer_reserve(struct buffer *b, size_t n) {
+	if (b->len + n > b->siz)
+		buffer_grow(b, b->len + n);
+	return &b->buf[b->len];
+}
+
+/* move unconsumed input down to the start of the buffer */
+static void buffer_compact(struct buffer *b) {
+	memmove(b->buf, b->buf + b->rd, b->off -= b->rd);
+	b->len -= b->rd;
+	b->rd = 0;
+}
+
+/* expect n bytes of input from the read cursor, making room for them if necessary */
+static void buffer_need(struct buffer *b, gsize n) {
+	if (b->rd + n > b->siz && b->rd)
+		buffer_compact(b);
+	buffer_set_len(b, b->rd + n);
+}
+
+/* Shrink an oversized buffer back to the target, if what it holds fits.
+ * Returns FALSE if it is still oversized. */
+static gboolean buffer_trim(struct buffer *b) {
+	gsize target = b->ws->buffer_target;
+	if (b->siz <= target)
+		return TRUE;
+	if (b->rd && b->len - b->rd <= target)
+		buffer_compact(b);
+	if (b->len > target)
+		return FALSE;
+	buffer_resize(b, target);
+	b->ws->stats.buffer_shrinks ++;
+	return TRUE;
+}
+
+static gboolean ws_shrink_cb(gpointer data) {
+	PurpleWebsocket *ws = data;
+
+	/* wait for a quiet period after the last spike */
+	if (g_get_monotonic_time() - ws->grown < (gint64)ws->buffer_idle * G_USEC_PER_SEC)
+		return TRUE;
+
+	/* (all of them, not stopping at the first that is still busy) */
+	if (buffer_trim(&ws->input) & buffer_trim(&ws->output) &
+			buffer_trim(&ws->message) & buffer_trim(&ws->deflated)) {
+		ws->shrink = 0;
+		return FALSE;
+	}
+	return TRUE;
+}
+
 void purple_websocket_abort(PurpleWebsocket *ws) {
 	if (ws->ssl_connection != NULL)
 		purple_ssl_close(ws->ssl_connection);
@@ -76,6 +189,14 @@ void purple_websocket_abort(PurpleWebsocket *ws) {
 	purple_debug_misc("websocket", "removing input %d\n", ws->inpa);
 	if (ws->inpa > 0)
 		purple_input_remove(ws->inpa);
+	if (ws->outpa > 0)
+		purple_input_remove(ws->outpa);
+	if (ws->flush > 0)
+		purple_timeout_remove(ws->flush);
+	if (ws->shrink > 0)
+		purple_timeout_remove(ws->shrink);
+	if (ws->drain > 0)
+		purple_timeout_remove(ws->drain);
 
 	if (ws->fd >= 0)
 		close(ws->fd);
@@ -83,6 +204,13 @@ void purple_websocket_abort(PurpleWebsocket *ws) {
 	g_free(ws->key);
 	g_free(ws->output.buf);
 	g_free(ws->input.buf);
+	g_free(ws->message.buf);
+	g_free(ws->deflated.buf);
+
+	if (ws->deflate)
+		inflateEnd(&ws->zin);
+	if (ws->zout_init)
+		deflateEnd(&ws->zout);
 
 	g_free(ws);
 }
@@ -126,6 +254,51 @@ static const char *find_header_content(const char *data, const char *name) {
 	return NULL;
 }
 
+static int window_bits(const char *v) {
+	char *e;
+	long bits = strtol(v, &e, 10);
+	return *e || bits < 8 || bits > 15 ? 0 : bits;
+}
+
+/* Accept the server's permessage-deflate parameters (the only extension we offer) */
+static gboolean ws_read_extensions(PurpleWebsocket *ws, const char *ext) {
+	gchar *line = g_strndup(ext, strcspn(ext, "\r\n"));
+	gchar **params = g_strsplit(line, ";", 0);
+	g_free(line);
+
+	gboolean ok = params[0] && !g_ascii_strcasecmp(g_strstrip(params[0]), "permessage-deflate");
+	int client_bits = 15;
+	unsigned i;
+	for (i = 1; ok && params[i]; i++) {
+		char *name = g_strstrip(params[i]);
+		char *val = strchr(name, '=');
+		if (val) {
+			*val++ = '\0';
+			g_strchomp(name);
+			g_strchug(val);
+		}
+
+		if (!g_ascii_strcasecmp(name, "server_no_context_takeover") && !val)
+			ws->zin_reset = TRUE;
+		else if (!g_ascii_strcasecmp(name, "client_no_context_takeover") && !val)
+			ws->zout_reset = TRUE;
+		else if (!g_ascii_strcasecmp(name, "server_max_window_bits") && val && window_bits(val))
+			; /* we always inflate with the largest window */
+		else if (!g_ascii_strcasecmp(name, "client_max_window_bits") && val && (client_bits = window_bits(val)))
+			;
+		else
+			ok = FALSE;
+	}
+	g_strfreev(params);
+
+	if (!ok || inflateInit2(&ws->zin, -15) != Z_OK)
+		return FALSE;
+	ws->deflate = TRUE;
+	/* zlib cannot produce raw deflate with a 256 byte window */
+	ws->zout_bits = client_bits > 8 ? client_bits : 0;
+	return TRUE;
+}
+
 static gboolean ws_read_headers(PurpleWebsocket *ws, const char *headers) {
 	const char *upgrade = skip_lws(find_header_content(headers, "Upgrade"));
 	if (upgrade && (g_ascii_strncasecmp(upgrade, "websocket", 9) || skip_lws(upgrade+9)))
@@ -154,29 +327,86 @@ static gboolean ws_read_headers(PurpleWebsocket *ws, const char *headers) {
 		g_free(b);
 	}
 
-	/* TODO: Sec-WebSocket-Extensions, Sec-WebSocket-Protocol */
+	const char *ext = skip_lws(find_header_content(headers, "Sec-WebSocket-Extensions"));
+	gboolean ext_ok = !ext || ((ws->flags & PURPLE_WEBSOCKET_DEFLATE) && ws_read_extensions(ws, ext));
 
-	if (strncmp(headers, "HTTP/1.1 101 ", 13) || !upgrade || !connection || !accept) {
+	/* TODO: Sec-WebSocket-Protocol */
+
+	if (strncmp(headers, "HTTP/1.1 101 ", 13) || !upgrade || !connection || !accept || !ext_ok) {
 		ws_error(ws, headers);
 		return FALSE;
 	}
 
 	ws->connected = TRUE;
+	ws->stats.opened = g_get_monotonic_time();
 	ws->callback(ws, ws->user_data, PURPLE_WEBSOCKET_OPEN, NULL, 0);
 	return TRUE;
 }
 
-static size_t ws_read_message(PurpleWebsocket *ws) {
-	uint8_t *input = ws->input.buf;
-	size_t len = ws->input.off;
+/* Hand a complete message to the callback (or answer it).
+ * Returns FALSE if the websocket is gone. */
+static gboolean ws_dispatch(PurpleWebsocket *ws, uint8_t op, guchar *msg, size_t len) {
+	purple_debug_misc("websocket", "message %x len %zd\n", op, len);
+	switch (op) {
+		case WS_OP_TEXT:
+		case WS_OP_BIN:
+			ws->stats.messages_in ++;
+			ws->stats.payload_in += len;
+		case WS_OP_PONG:
+		case WS_OP_CLOS:
+			ws->callback(ws, ws->user_data, (PurpleWebsocketOp)op, msg, len);
+			if (op == WS_OP_CLOS) {
+				ws->closed |= PURPLE_INPUT_READ;
+				if (ws->closed & PURPLE_INPUT_WRITE) {
+					purple_websocket_abort(ws);
+					return FALSE;
+				} else
+					purple_websocket_send(ws, PURPLE_WEBSOCKET_CLOSE, NULL, 0);
+			}
+			return TRUE;
+		case WS_OP_PING:
+			purple_websocket_send(ws, PURPLE_WEBSOCKET_PONG, msg, len);
+			return TRUE;
+		default:
+			ws_error(ws, "Unknown frame op");
+			return FALSE;
+	}
+}
+
+/* Inflate (part of) a compressed message onto ws->message */
+static gboolean ws_inflate(PurpleWebsocket *ws, const guchar *in, size_t len) {
+	gint64 start = g_get_monotonic_time();
+	z_stream *z = &ws->zin;
+	z->next_in = (Bytef *)in;
+	z->avail_in = len;
+	int r;
+	do {
+		z->next_out = buffer_reserve(&ws->message, 4096);
+		z->avail_out = ws->message.siz - ws->message.len;
+		r = inflate(z, Z_SYNC_FLUSH);
+		ws->message.len = z->next_out - ws->message.buf;
+	} while (r == Z_OK && (z->avail_in || !z->avail_out));
+	ws->stats.inflate_usec += g_get_monotonic_time() - start;
+
+	if (r == Z_STREAM_END)
+		/* not expected, but harmless: the next message starts a new stream */
+		inflateReset(z);
+	else if (r != Z_OK && r != Z_BUF_ERROR) {
+		ws_error(ws, z->msg ?: "Invalid compressed message");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* Parse one frame at the read cursor, in place.
+ * Unfragmented messages are dispatched straight from the input buffer;
+ * fragments (and compressed messages) are appended to ws->message until the final one arrives.
+ * Returns the number of bytes consumed, more than are available if incomplete, or 0 on error. */
+static size_t ws_read_frame(PurpleWebsocket *ws) {
+	uint8_t *input = ws->input.buf + ws->input.rd;
+	size_t len = ws->input.off - ws->input.rd;
 	size_t off = 0;
-	struct {
-		guchar *p;
-		size_t l;
-	} frag[MAX_FRAG];
-	unsigned fi;
 
-	for (fi = 0; fi < MAX_FRAG; fi ++) {
 #define GETN(N) ({ \
 		if (len-off < (N)) \
 			return off+N; \
@@ -186,105 +416,94 @@ static size_t ws_read_message(PurpleWebsocket *ws) {
 	})
 #define GET(T) (*(T*)GETN(sizeof(T)))
 
-		if (len-off < 2)
-			return off+2;
-		uint8_t header = GET(uint8_t);
-		if (header & ~(WS_OP_MASK|WS_FIN)) {
-			ws_error(ws, "Unsupported RSV flag");
-			return 0;
-		}
-		uint8_t mlen = GET(uint8_t);
-		if (mlen & WS_MASK) {
-			ws_error(ws, "Masked frame");
-			return 0;
-		}
-		uint64_t plen = mlen & ~WS_MASK;
-		switch (plen) {
-			case 127:
-				plen = GUINT64_FROM_BE(GET(uint64_t));
-				break;
-			case 126:
-				plen = ntohs(GET(uint16_t));
-				break;
-		}
-		frag[fi].l = plen;
-		frag[fi].p = GETN(plen);
-	
+	if (len-off < 2)
+		return off+2;
+	uint8_t header = GET(uint8_t);
+	if (header & ~(WS_OP_MASK|WS_FIN|WS_RSV1)) {
+		ws_error(ws, "Unsupported RSV flag");
+		return 0;
+	}
+	uint8_t mlen = GET(uint8_t);
+	if (mlen & WS_MASK) {
+		ws_error(ws, "Masked frame");
+		return 0;
+	}
+	uint64_t plen = mlen & ~WS_MASK;
+	switch (plen) {
+		case 127:
+			plen = GUINT64_FROM_BE(GET(uint64_t));
+			break;
+		case 126:
+			plen = ntohs(GET(uint16_t));
+			break;
+	}
+	guchar *p = GETN(plen);
+
 #undef GET
 #undef GETN
 
-		if (header & WS_FIN) {
-			/* consolidate all the fragments after the first */
-			unsigned i;
-			for (i = 1; i <= fi; i++) {
-				memmove(&frag[0].p[frag[0].l], frag[i].p, frag[i].l);
-				frag[0].l += frag[i].l;
-			}
+	uint8_t op = header & WS_OP_MASK;
+	/* RSV1 marks the first frame of a compressed message */
+	if ((header & WS_RSV1) && (!ws->deflate || op == WS_OP_CONT || (op & 0x08))) {
+		ws_error(ws, "Unsupported RSV flag");
+		return 0;
+	}
 
-			purple_debug_misc("websocket", "message %x len %zd\n", input[0], frag[0].l);
-			uint8_t op = input[0] & WS_OP_MASK;
-			switch (op) {
-				case WS_OP_TEXT:
-				case WS_OP_BIN:
-				case WS_OP_PONG:
-				case WS_OP_CLOS:
-					ws->callback(ws, ws->user_data, (PurpleWebsocketOp)op, frag[0].p, frag[0].l);
-					if (op == WS_OP_CLOS) {
-						ws->closed |= PURPLE_INPUT_READ;
-						if (ws->closed & PURPLE_INPUT_WRITE) {
-							purple_websocket_abort(ws);
-							return 0;
-						} else
-							purple_websocket_send(ws, PURPLE_WEBSOCKET_CLOSE, NULL, 0);
-					}
-					break;
-				case WS_OP_PING:
-					purple_websocket_send(ws, PURPLE_WEBSOCKET_PONG, NULL, 0);
-					break;
-				default:
-					ws_error(ws, "Unknown frame op");
-			}
-			return off;
+	if (op & 0x08) {
+		/* control frames may come between fragments, but not be fragmented themselves */
+		if (!(header & WS_FIN)) {
+			ws_error(ws, "Fragmented control frame");
+			return 0;
 		}
+		return ws_dispatch(ws, op, p, plen) ? off : 0;
 	}
 
-	ws_error(ws, "Maximum fragment count exceeded");
-	return 0;
-}
-
-static void ws_input_cb(gpointer data, gint source, PurpleInputCondition cond);
-
-static gboolean ws_input(PurpleWebsocket *ws) {
-	if (ws->inpa) {
-		purple_input_remove(ws->inpa);
-		ws->inpa = 0;
+	if (op == WS_OP_CONT) {
+		if (!ws->message_op) {
+			ws_error(ws, "Unexpected continuation frame");
+			return 0;
+		}
+	} else if (ws->message_op) {
+		ws_error(ws, "Incomplete fragmented message");
+		return 0;
+	} else if ((header & (WS_FIN|WS_RSV1)) == WS_FIN)
+		return ws_dispatch(ws, op, p, plen) ? off : 0;
+	else {
+		ws->message_op = op;
+		ws->message_deflated = header & WS_RSV1;
 	}
 
-	if (ws->output.off) {
-		/* always none left in practice: */
-		memmove(ws->output.buf, ws->output.buf + ws->output.off, ws->output.len -= ws->output.off);
-		ws->output.off = 0;
+	if (ws->message_deflated) {
+		if (!ws_inflate(ws, p, plen))
+			return 0;
+	} else if (plen) {
+		memcpy(buffer_reserve(&ws->message, plen), p, plen);
+		ws->message.len += plen;
 	}
 
-	PurpleInputCondition cond = (ws->ssl_connection ? 0 : PURPLE_INPUT_READ); /* permanent purple_ssl_input_add for ssl */
-
-	if (ws->output.len)
-		cond |= PURPLE_INPUT_WRITE;
-	else if (ws->closed & PURPLE_INPUT_READ) {
-		purple_websocket_abort(ws);
-		return FALSE;
+	if (header & WS_FIN) {
+		if (ws->message_deflated) {
+			if (!ws_inflate(ws, WS_DEFLATE_TAIL, sizeof(WS_DEFLATE_TAIL)))
+				return 0;
+			if (ws->zin_reset)
+				inflateReset(&ws->zin);
+		}
+		op = ws->message_op;
+		ws->message_op = 0;
+		if (!ws_dispatch(ws, op, ws->message.buf, ws->message.len))
+			return 0;
+		ws->message.len = 0;
 	}
-
-	if (cond)
-		ws->inpa = purple_input_add(ws->fd, cond, ws_input_cb, ws);
-	return TRUE;
+	return off;
 }
 
-static void ws_input_cb(gpointer data, G_GNUC_UNUSED gint source, PurpleInputCondition cond) {
-	PurpleWebsocket *ws = data;
+static void ws_input_cb(gpointer data, gint source, PurpleInputCondition cond);
 
-	while (cond & PURPLE_INPUT_WRITE) {
-		g_return_if_fail(ws->output.off < ws->output.len);
+/* Write out as much of the output as the connection will take.
+ * The write watcher is only added while the connection is backed up.
+ * Returns FALSE if the websocket is gone. */
+static gboolean ws_flush(PurpleWebsocket *ws) {
+	while (ws->output.off < ws->output.len) {
 		ssize_t len = ws->ssl_connection
 			? (ssize_t)purple_ssl_write(ws->ssl_connection, ws->output.buf + ws->output.off, ws->output.len - ws->output.off)
 			: write(ws->fd, ws->output.buf + ws->output.off, ws->output.len - ws->output.off);
@@ -292,13 +511,15 @@ static void ws_input_cb(gpointer data, G_GNUC_UNUSED gint source, PurpleInputCon
 		if (len < 0) {
 			if (errno != EAGAIN) {
 				ws_error(ws, g_strerror(errno));
-				return;
+				return FALSE;
 			}
-			cond &= ~PURPLE_INPUT_WRITE;
-		} else if ((ws->output.off += len) >= ws->output.len) {
-			if (!ws_input(ws))
-				return;
-			break;
+			if (ws->output.off) {
+				memmove(ws->output.buf, ws->output.buf + ws->output.off, ws->output.len -= ws->output.off);
+				ws->output.off = 0;
+			}
+			if (!ws->outpa)
+				ws->outpa = purple_input_add(ws->fd, PURPLE_INPUT_WRITE, ws_input_cb, ws);
+			return TRUE;
 		}
 
 		/*
@@ -306,25 +527,77 @@ static void ws_input_cb(gpointer data, G_GNUC_UNUSED gint source, PurpleInputCon
 		purple_debug_misc("websocket", "send: %s\n", enc);
 		g_free(enc);
 		*/
+
+		ws->stats.wire_out += len;
+		ws->stats.flush_writes ++;
+		ws->output.off += len;
 	}
 
-	while (cond & PURPLE_INPUT_READ) {
-		g_return_if_fail(ws->input.off < ws->input.len);
-		ssize_t len = ws->ssl_connection
-			? (ssize_t)purple_ssl_read(ws->ssl_connection, ws->input.buf + ws->input.off, ws->input.siz - ws->input.off)
-			: read(ws->fd, ws->input.buf + ws->input.off, ws->input.siz - ws->input.off);
+	ws->output.off = ws->output.len = 0;
+	if (ws->outpa) {
+		purple_input_remove(ws->outpa);
+		ws->outpa = 0;
+	}
 
-		if (len < 0) {
-			if (errno != EAGAIN) {
-				ws_error(ws, g_strerror(errno));
-				return;
+	if (ws->closed & PURPLE_INPUT_READ) {
+		purple_websocket_abort(ws);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static gboolean ws_flush_cb(gpointer data) {
+	PurpleWebsocket *ws = data;
+	ws->flush = 0;
+	if (!ws->outpa)
+		ws_flush(ws);
+	return FALSE;
+}
+
+static gboolean ws_drain_cb(gpointer data) {
+	PurpleWebsocket *ws = data;
+	ws->drain = 0;
+	ws_input_cb(ws, ws->fd, PURPLE_INPUT_READ);
+	return FALSE;
+}
+
+static void ws_input_cb(gpointer data, G_GNUC_UNUSED gint source, PurpleInputCondition cond) {
+	PurpleWebsocket *ws = data;
+
+	if ((cond & PURPLE_INPUT_WRITE) && !ws_flush(ws))
+		return;
+	if (!(cond & PURPLE_INPUT_READ))
+		return;
+
+	ws->stats.read_wakeups ++;
+	gsize budget = ws->read_limit ?: G_MAXSIZE;
+	gboolean more = TRUE;
+	while (more) {
+		g_return_if_fail(ws->input.off < ws->input.len);
+		/* only pay for moving leftover input down when the space after it runs short */
+		if (ws->input.rd && ws->input.siz - ws->input.off < ws->input.siz/4)
+			buffer_compact(&ws->input);
+
+		/* Take everything available (including records already decrypted by
+		 * the SSL layer, which poll knows nothing about) that fits, before
+		 * parsing any of it, so the frames in it are dispatched together. */
+		const char *error = NULL;
+		gsize got = 0;
+		while (ws->input.off < ws->input.siz && got < budget) {
+			gsize want = MIN(ws->input.siz - ws->input.off, budget - got);
+			ssize_t len = ws->ssl_connection
+				? (ssize_t)purple_ssl_read(ws->ssl_connection, ws->input.buf + ws->input.off, want)
+				: read(ws->fd, ws->input.buf + ws->input.off, want);
+
+			if (len <= 0) {
+				if (len == 0)
+					error = "Connection closed";
+				else if (errno != EAGAIN)
+					error = g_strerror(errno);
+				more = FALSE;
+				break;
 			}
-			cond &= ~PURPLE_INPUT_READ;
-		}
-		else if (len == 0) {
-			ws_error(ws, "Connection closed");
-			return;
-		} else {
+
 			/*
 			gchar *enc = purple_base16_encode(ws->input.buf + ws->input.off, len);
 			purple_debug_misc("websocket", "recv %zu/%zu: %s\n", ws->input.off+len, ws->input.len, enc);
@@ -332,58 +605,175 @@ static void ws_input_cb(gpointer data, G_GNUC_UNUSED gint source, PurpleInputCon
 			*/
 
 			ws->input.off += len;
-
-			if (!ws->connected) {
-				/* search for the end of headers in the new block (backing up 4-1) */
-				char *resp = (char *)ws->input.buf;
-				int backup = len + 3;
-				if (backup > ws->input.off)
-					backup = ws->input.off;
-				char *eoh = g_strstr_len(resp + ws->input.off - backup, backup, "\r\n\r\n");
-
-				if (eoh) {
-					/* got all the headers now */
-					*eoh = '\0';
-					eoh += 4;
-					if (!ws_read_headers(ws, resp))
-						return;
-
-					memmove(ws->input.buf, eoh, ws->input.off -= eoh - resp);
-					ws->input.len = 2;
-				}
-				else if (ws->input.off >= ws->input.len) {
-					ws_error(ws, "Response headers too long");
-					return;
-				}
-				else
+			got += len;
+		}
+		budget -= got;
+		ws->stats.wire_in += got;
+
+		if (got && !ws->connected) {
+			/* search for the end of headers in the new block (backing up 4-1) */
+			char *resp = (char *)ws->input.buf;
+			gsize backup = MIN(got + 3, ws->input.off);
+			char *eoh = g_strstr_len(resp + ws->input.off - backup, backup, "\r\n\r\n");
+
+			if (eoh) {
+				/* got all the headers now */
+				*eoh = '\0';
+				eoh += 4;
+				if (!ws_read_headers(ws, resp))
 					return;
+
+				ws->input.rd = eoh - (char *)ws->input.buf;
+				buffer_need(&ws->input, 2);
 			}
-			
-			while (ws->input.off >= ws->input.len) {
-				size_t r = ws_read_message(ws);
-				if (!r) /* error */
-					return;
-				else if (r > ws->input.off) {
-					/* need more */
-					buffer_set_len(&ws->input, r);
-				} else {
-					/* consumed some */
-					memmove(ws->input.buf, ws->input.buf + r, ws->input.off -= r);
-					ws->input.len = 2;
-				}
+			else if (ws->input.off >= ws->input.len) {
+				ws_error(ws, "Response headers too long");
+				return;
+			}
+		}
+
+		while (ws->connected && ws->input.off >= ws->input.len) {
+			size_t r = ws_read_frame(ws);
+			if (!r) /* error */
+				return;
+			else if (r > ws->input.off - ws->input.rd) {
+				/* need more */
+				buffer_need(&ws->input, r);
+			} else {
+				/* consumed some: just advance past it */
+				ws->stats.frames_in ++;
+				if ((ws->input.rd += r) == ws->input.off)
+					ws->input.rd = ws->input.off = 0;
+				buffer_need(&ws->input, 2);
 			}
 		}
+
+		if (error) {
+			ws_error(ws, error);
+			return;
+		}
+
+		if (more && !budget) {
+			/* Yield to the rest of the main loop, but come back for the rest
+			 * by timer: if it is already decrypted the socket may never poll readable. */
+			ws->stats.read_limited ++;
+			if (!ws->drain)
+				ws->drain = purple_timeout_add(0, ws_drain_cb, ws);
+			return;
+		}
 	}
 }
 
-void purple_websocket_send(PurpleWebsocket *ws, PurpleWebsocketOp op, const guchar *msg, size_t len) {
-	g_return_if_fail(ws->connected && !(ws->closed & PURPLE_INPUT_WRITE));
-	g_return_if_fail(!(op & ~WS_OP_MASK));
-	gboolean buf = ws->output.len;
+/* Compress a message onto ws->deflated */
+static gboolean ws_deflate(PurpleWebsocket *ws, const guchar *msg, size_t len) {
+	z_stream *z = &ws->zout;
+	if (!ws->zout_init) {
+		if (deflateInit2(z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -ws->zout_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			ws->zout_bits = 0;
+			return FALSE;
+		}
+		ws->zout_init = TRUE;
+	}
+
+	gint64 start = g_get_monotonic_time();
+	ws->deflated.len = 0;
+	z->next_in = (Bytef *)msg;
+	z->avail_in = len;
+	int r;
+	do {
+		z->next_out = buffer_reserve(&ws->deflated, len + 64);
+		z->avail_out = ws->deflated.siz - ws->deflated.len;
+		r = deflate(z, Z_SYNC_FLUSH);
+		ws->deflated.len = z->next_out - ws->deflated.buf;
+	} while (r == Z_OK && !z->avail_out);
+	if (ws->zout_reset)
+		deflateReset(z);
+	ws->stats.deflate_usec += g_get_monotonic_time() - start;
+
+	if ((r != Z_OK && r != Z_BUF_ERROR) || ws->deflated.len < sizeof(WS_DEFLATE_TAIL) ||
+			memcmp(ws->deflated.buf + ws->deflated.len - sizeof(WS_DEFLATE_TAIL), WS_DEFLATE_TAIL, sizeof(WS_DEFLATE_TAIL))) {
+		/* the context is now out of step with the server's, so give up compressing */
+		purple_debug_error("websocket", "deflate failed: %s\n", z->msg ?: "incomplete flush");
+		ws->zout_bits = 0;
+		return FALSE;
+	}
+	ws->deflated.len -= sizeof(WS_DEFLATE_TAIL);
+	return TRUE;
+}
+
+/* Masking: dst may be the same as src, or before it within the same buffer */
+static void mask_scalar(guchar *dst, const guchar *src, size_t len, uint32_t mask) {
+	size_t i;
+	for (i = 0; i+4 <= len; i+=4) {
+		uint32_t v;
+		memcpy(&v, &src[i], 4);
+		v ^= mask;
+		memcpy(&dst[i], &v, 4);
+	}
+	for (; i < len; i++)
+		dst[i] = src[i] ^ ((uint8_t*)&mask)[i&3];
+}
+
+#if !defined(WS_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define WS_MASK_X86
+#include <immintrin.h>
+
+/* (blocks are a multiple of 4 bytes, so the mask lines up again for the tail) */
+__attribute__((target("sse2")))
+static void mask_sse2(guchar *dst, const guchar *src, size_t len, uint32_t mask) {
+	const __m128i m = _mm_set1_epi32(mask);
+	size_t i;
+	for (i = 0; i+16 <= len; i+=16)
+		_mm_storeu_si128((__m128i *)&dst[i], _mm_xor_si128(_mm_loadu_si128((const __m128i *)&src[i]), m));
+	mask_scalar(&dst[i], &src[i], len-i, mask);
+}
+
+__attribute__((target("avx2")))
+static void mask_avx2(guchar *dst, const guchar *src, size_t len, uint32_t mask) {
+	const __m256i m = _mm256_set1_epi32(mask);
+	size_t i;
+	for (i = 0; i+32 <= len; i+=32)
+		_mm256_storeu_si256((__m256i *)&dst[i], _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&src[i]), m));
+	mask_sse2(&dst[i], &src[i], len-i, mask);
+}
+#endif
+
+static void mask_init(guchar *dst, const guchar *src, size_t len, uint32_t mask);
+static void (*mask_payload)(guchar *dst, const guchar *src, size_t len, uint32_t mask) = mask_init;
+
+static void mask_init(guchar *dst, const guchar *src, size_t len, uint32_t mask) {
+	mask_payload = mask_scalar;
+#ifdef WS_MASK_X86
+	if (__builtin_cpu_supports("avx2"))
+		mask_payload = mask_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		mask_payload = mask_sse2;
+#endif
+	mask_payload(dst, src, len, mask);
+}
+
+/* Append a frame to the output, masking msg into place.
+ * msg may be in the output buffer itself, at least WS_MAX_HEADER bytes past its end (see purple_websocket_reserve). */
+static void ws_frame(PurpleWebsocket *ws, PurpleWebsocketOp op, const guchar *msg, size_t len) {
+	uint8_t rsv = 0;
+
+	if (op == PURPLE_WEBSOCKET_TEXT || op == PURPLE_WEBSOCKET_BINARY) {
+		ws->stats.messages_out ++;
+		ws->stats.payload_out += len;
+		/* (empty messages are simpler left as they are) */
+		if ((ws->flags & PURPLE_WEBSOCKET_DEFLATE_SEND) && ws->zout_bits && len && ws_deflate(ws, msg, len)) {
+			msg = ws->deflated.buf;
+			len = ws->deflated.len;
+			rsv = WS_RSV1;
+		}
+	}
+
+	/* for a reserved payload this is already there, so msg cannot move */
+	buffer_reserve(&ws->output, WS_MAX_HEADER + len);
 
 #define ADD(T, V) BUFFER_ADD(&ws->output, T, V)
 
-	ADD(uint8_t, WS_FIN | op);
+	ADD(uint8_t, WS_FIN | rsv | op);
 	if (len > UINT16_MAX) {
 		ADD(uint8_t, WS_MASK | 127);
 		ADD(uint64_t, GUINT64_TO_BE(len));
@@ -399,18 +789,37 @@ void purple_websocket_send(PurpleWebsocket *ws, PurpleWebsocketOp op, const guch
 
 #undef ADD
 
-	guchar *p = buffer_incr(&ws->output, len);
-	size_t i;
-	for (i = 0; i+3 < len; i+=4)
-		*(uint32_t*)&p[i] = *(uint32_t*)&msg[i] ^ mask;
-	for (; i < len; i++)
-		p[i] = msg[i] ^ ((uint8_t*)&mask)[i&3];
+	/* a reserved payload moves down over any unused header space as it is masked */
+	mask_payload(buffer_incr(&ws->output, len), msg, len, mask);
+	/* done with the compressed copy, so it doesn't hold up buffer_trim */
+	if (rsv)
+		ws->deflated.len = 0;
 
 	if (op == PURPLE_WEBSOCKET_CLOSE)
 		ws->closed |= PURPLE_INPUT_WRITE;
 
-	if (!buf)
-		ws_input(ws);
+	/* frames sent before we get back to the main loop all go out in one write */
+	ws->stats.frames_out ++;
+	if (!ws->flush && !ws->outpa)
+		ws->flush = purple_timeout_add(0, ws_flush_cb, ws);
+}
+
+void purple_websocket_send(PurpleWebsocket *ws, PurpleWebsocketOp op, const guchar *msg, size_t len) {
+	g_return_if_fail(ws->connected && !(ws->closed & PURPLE_INPUT_WRITE));
+	g_return_if_fail(!(op & ~WS_OP_MASK));
+	ws_frame(ws, op, msg, len);
+}
+
+guchar *purple_websocket_reserve(PurpleWebsocket *ws, size_t len) {
+	g_return_val_if_fail(ws->connected && !(ws->closed & PURPLE_INPUT_WRITE), NULL);
+	return buffer_reserve(&ws->output, WS_MAX_HEADER + len) + WS_MAX_HEADER;
+}
+
+void purple_websocket_commit(PurpleWebsocket *ws, PurpleWebsocketOp op, size_t len) {
+	g_return_if_fail(ws->connected && !(ws->closed & PURPLE_INPUT_WRITE));
+	g_return_if_fail(!(op & ~WS_OP_MASK));
+	g_return_if_fail(ws->output.len + WS_MAX_HEADER + len <= ws->output.siz);
+	ws_frame(ws, op, ws->output.buf + ws->output.len + WS_MAX_HEADER, len);
 }
 
 static void wss_input_cb(gpointer data, G_GNUC_UNUSED PurpleSslConnection *ssl_connection, PurpleInputCondition cond)
@@ -425,8 +834,8 @@ static void wss_connect_cb(gpointer data, PurpleSslConnection *ssl_connection, G
 	ws->fd = ssl_connection->fd;
 	purple_ssl_input_add(ws->ssl_connection, wss_input_cb, ws);
 
-	if (ws_input(ws))
-		ws_input_cb(ws, ws->fd, PURPLE_INPUT_WRITE);
+	/* send the request */
+	ws_flush(ws);
 }
 
 static void wss_error_cb(G_GNUC_UNUSED PurpleSslConnection *ssl_connection, PurpleSslErrorType error, gpointer data) {
@@ -445,13 +854,14 @@ static void ws_connect_cb(gpointer data, gint source, const gchar *error_message
 	}
 
 	ws->fd = source;
+	ws->inpa = purple_input_add(ws->fd, PURPLE_INPUT_READ, ws_input_cb, ws);
 
-	if (ws_input(ws))
-		ws_input_cb(ws, ws->fd, PURPLE_INPUT_WRITE);
+	/* send the request */
+	ws_flush(ws);
 }
 
 PurpleWebsocket *purple_websocket_connect(PurpleAccount *account,
-		const char *url, const char *protocol,
+		const char *url, const char *protocol, PurpleWebsocketFlags flags,
 		PurpleWebsocketCallback callback, void *user_data) {
 	gboolean ssl = FALSE;
 
@@ -475,7 +885,12 @@ PurpleWebsocket *purple_websocket_connect(PurpleAccount *account,
 	PurpleWebsocket *ws = g_new0(PurpleWebsocket, 1);
 	ws->callback = callback;
 	ws->user_data = user_data;
+	ws->flags = flags;
 	ws->fd = -1;
+	ws->input.ws = ws->output.ws = ws->message.ws = ws->deflated.ws = ws;
+	ws->buffer_target = WS_BUFFER_TARGET;
+	ws->buffer_idle = WS_BUFFER_IDLE;
+	ws->read_limit = WS_READ_LIMIT;
 
 	char *host, *path;
 	int port;
@@ -503,11 +918,14 @@ Sec-WebSocket-Key: %s\r\n\
 Sec-WebSocket-Version: 13\r\n", path, host, ws->key);
 		if (protocol)
 			g_string_append_printf(request, "Sec-WebSocket-Protocol: %s\r\n", protocol);
+		if (flags & PURPLE_WEBSOCKET_DEFLATE)
+			g_string_append(request, "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n");
 		g_string_append(request, "\r\n");
 
 		ws->output.len = request->len;
 		ws->output.siz = request->allocated_len;
 		ws->output.buf = (guchar *)g_string_free(request, FALSE);
+		ws->stats.buffer_size = ws->stats.buffer_peak = ws->output.siz;
 
 		/* allocate space for responses (headers) */
 		buffer_set_len(&ws->input, 4096);
@@ -530,3 +948,24 @@ Sec-WebSocket-Version: 13\r\n", path, host, ws->key);
 
 	return ws;
 }
+
+void purple_websocket_set_buffer_policy(PurpleWebsocket *ws, gsize target, guint idle_secs) {
+	ws->buffer_target = target;
+	ws->buffer_idle = idle_secs;
+	if (ws->shrink > 0) {
+		purple_timeout_remove(ws->shrink);
+		ws->shrink = 0;
+	}
+	if (idle_secs && ws->stats.buffer_size > target)
+		ws->shrink = purple_timeout_add_seconds(idle_secs, ws_shrink_cb, ws);
+}
+
+void purple_websocket_set_read_limit(PurpleWebsocket *ws, gsize limit) {
+	ws->read_limit = limit;
+}
+
+const PurpleWebsocketStats *purple_websocket_get_stats(PurpleWebsocket *ws) {
+	ws->stats.deflate = ws->deflate;
+	ws->stats.queued = ws->output.len - ws->output.off;
+	return &ws->stats;
+}
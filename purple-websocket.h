@@ -15,10 +15,49 @@ typedef enum _PurpleWebsocketOp {
 	PURPLE_WEBSOCKET_OPEN   = 0x10,
 } PurpleWebsocketOp;
 
+typedef enum _PurpleWebsocketFlags {
+	PURPLE_WEBSOCKET_DEFLATE      = 1 << 0, /* offer permessage-deflate, for received messages */
+	PURPLE_WEBSOCKET_DEFLATE_SEND = 1 << 1, /* also compress sent messages, if negotiated */
+} PurpleWebsocketFlags;
+
+typedef struct _PurpleWebsocketStats {
+	guint64 wire_in, wire_out; /* bytes read and written on the connection */
+	guint64 payload_in, payload_out; /* TEXT and BINARY message bytes, uncompressed */
+	guint64 messages_in, messages_out;
+	gint64 inflate_usec, deflate_usec; /* time spent (de)compressing */
+	guint64 frames_out; /* frames queued (including control frames) */
+	guint64 flush_writes; /* writes they went out in */
+	gsize queued; /* bytes waiting to be written */
+	gsize buffer_size, buffer_peak; /* bytes allocated for buffers, now and at most */
+	guint64 buffer_grows, buffer_shrinks;
+	guint64 read_wakeups; /* times woken up to read */
+	guint64 frames_in; /* frames parsed (including control frames and fragments) */
+	guint64 read_limited; /* wakeups that stopped at the read limit */
+	gint64 opened; /* monotonic time of the handshake */
+	gboolean deflate; /* permessage-deflate was negotiated */
+} PurpleWebsocketStats;
+
+/* For TEXT and BINARY messages, msg points into the websocket's own buffer,
+ * and may be modified in place by the callback (but not retained). */
 typedef void (*PurpleWebsocketCallback)(PurpleWebsocket *ws, gpointer user_data, PurpleWebsocketOp op, const guchar *msg, size_t len);
 
-PurpleWebsocket *purple_websocket_connect(PurpleAccount *account, const char *url, const char *protocol, PurpleWebsocketCallback callback, void *user_data);
+PurpleWebsocket *purple_websocket_connect(PurpleAccount *account, const char *url, const char *protocol, PurpleWebsocketFlags flags, PurpleWebsocketCallback callback, void *user_data);
 void purple_websocket_send(PurpleWebsocket *ws, PurpleWebsocketOp op, const guchar *msg, size_t len);
+/* Serialise a message straight into the output buffer: reserve returns room
+ * for (at least) len bytes of payload, and commit sends the first len of them,
+ * masking them in place.  Reserve may be called again to grow the room (the
+ * payload so far is kept, but may move); nothing else may be sent, and the
+ * main loop must not run, until the commit. */
+guchar *purple_websocket_reserve(PurpleWebsocket *ws, size_t len);
+void purple_websocket_commit(PurpleWebsocket *ws, PurpleWebsocketOp op, size_t len);
 void purple_websocket_abort(PurpleWebsocket *ws);
+/* Buffers grow in powers of two as needed, and any that have grown past
+ * target are shrunk back to it once none has needed to for idle_secs
+ * (0 to never shrink).  The default is 16 KB after 60 seconds. */
+void purple_websocket_set_buffer_policy(PurpleWebsocket *ws, gsize target, guint idle_secs);
+/* Each wakeup reads everything available, up to limit bytes (0 for no
+ * limit, default 256 KB), before going back to the main loop. */
+void purple_websocket_set_read_limit(PurpleWebsocket *ws, gsize limit);
+const PurpleWebsocketStats *purple_websocket_get_stats(PurpleWebsocket *ws);
 
 #endif
@@ -5,6 +5,74 @@
 #include "slack-channel.h"
 #include "slack-user.h"
 
+/* largest response accepted */
+#define SLACK_API_MAX_LEN (4096*1024)
+/* keep-alive connections per host, and how long they're kept idle */
+#define SLACK_API_CONNS 4
+#define SLACK_API_IDLE 60
+/* calls in flight at once (background calls leave one of these free) */
+#define SLACK_API_INFLIGHT SLACK_API_CONNS
+/* times a rate limited call is retried, and how long to wait without Retry-After */
+#define SLACK_API_RETRIES 3
+#define SLACK_API_RETRY_AFTER 30
+
+typedef enum {
+	SLACK_API_INTERACTIVE = 0, /* someone is waiting on it */
+	SLACK_API_BACKGROUND = 1, /* loading and syncing */
+} SlackAPIPriority;
+
+/* https://api.slack.com/docs/rate-limits: calls per minute, and how many
+ * can go out at once after a quiet spell.  Methods on tier 0 aren't held
+ * back here at all, only by Retry-After once Slack says so. */
+static const struct api_tier {
+	unsigned per_minute, burst;
+} api_tiers[] = {
+	{   1,  3 },
+	{  20,  5 },
+	{  50, 10 },
+	{ 100, 20 },
+};
+
+/* coalesce: identical calls made while one is pending get its response.
+ * The paged lists fetch one page at a time anyway, and Slack allows them
+ * short bursts well past their tier, so they are left to Retry-After. */
+static const struct api_method {
+	const char *name;
+	unsigned tier;
+	SlackAPIPriority priority;
+	gboolean coalesce;
+} api_methods[] = {
+	{ "rtm.connect",        1, SLACK_API_INTERACTIVE, FALSE },
+	{ "users.list",         0, SLACK_API_BACKGROUND,  FALSE },
+	{ "channels.list",      0, SLACK_API_BACKGROUND,  FALSE },
+	{ "groups.list",        0, SLACK_API_BACKGROUND,  FALSE },
+	{ "im.list",            0, SLACK_API_BACKGROUND,  FALSE },
+	{ "channels.history",   3, SLACK_API_BACKGROUND,  FALSE },
+	{ "groups.history",     3, SLACK_API_BACKGROUND,  FALSE },
+	{ "im.history",         3, SLACK_API_BACKGROUND,  FALSE },
+	{ "mpim.history",       3, SLACK_API_BACKGROUND,  FALSE },
+	{ "channels.mark",      3, SLACK_API_BACKGROUND,  FALSE },
+	{ "groups.mark",        3, SLACK_API_BACKGROUND,  FALSE },
+	{ "im.mark",            3, SLACK_API_BACKGROUND,  FALSE },
+	{ "mpim.mark",          3, SLACK_API_BACKGROUND,  FALSE },
+	{ "channels.info",      3, SLACK_API_INTERACTIVE, TRUE },
+	{ "groups.info",        3, SLACK_API_INTERACTIVE, TRUE },
+	{ "im.open",            3, SLACK_API_INTERACTIVE, TRUE },
+	{ "users.info",         4, SLACK_API_INTERACTIVE, TRUE },
+	{ "users.setActive",    2, SLACK_API_INTERACTIVE, FALSE },
+	{ "users.setPresence",  2, SLACK_API_INTERACTIVE, FALSE },
+	{ "chat.command",       2, SLACK_API_INTERACTIVE, FALSE },
+};
+static const struct api_method api_method_default = { NULL, 3, SLACK_API_INTERACTIVE, FALSE };
+
+typedef struct _SlackAPIBucket {
+	const char *name;
+	const struct api_method *method;
+	double tokens;
+	gint64 updated; /* when tokens was last topped up */
+	gint64 blocked_until; /* by Retry-After */
+} SlackAPIBucket;
+
 PurpleConnectionError slack_api_connection_error(const gchar *error) {
 	if (!g_strcmp0(error, "not_authed"))
 		return PURPLE_CONNECTION_ERROR_INVALID_USERNAME;
@@ -14,83 +82,543 @@ PurpleConnectionError slack_api_connection_error(const gchar *error) {
 	return PURPLE_CONNECTION_ERROR_NETWORK_ERROR;
 }
 
+void slack_api_init(SlackAccount *sa) {
+	unsigned i;
+	sa->api_calls = g_hash_table_new(g_direct_hash, g_direct_equal);
+	sa->api_buckets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	sa->api_pending = g_hash_table_new(g_str_hash, g_str_equal);
+	sa->api_headers = g_strdup_printf("Authorization: Bearer %s\r\nContent-Type: application/x-www-form-urlencoded\r\n", sa->token);
+	for (i = 0; i < SLACK_API_PRIORITIES; i++)
+		g_queue_init(&sa->api_queue[i]);
+	if (purple_account_get_bool(sa->account, "http_keepalive", TRUE))
+		sa->http = purple_http_pool_new(sa->account, SLACK_API_CONNS, SLACK_API_IDLE);
+}
+
 struct _SlackAPICall {
 	SlackAccount *sa;
 	PurpleUtilFetchUrlData *fetch;
+	PurpleHttpPoolRequest *req;
+	char *url;
+	SlackAPIBucket *bucket;
+	gint64 queued; /* when first queued */
+	unsigned retries; /* after being rate limited */
+	gboolean pending; /* in sa->api_pending, for others to coalesce with */
+	GSList *waiters; /* identical SlackAPICalls, answered with this one */
 	SlackAPICallback *callback;
+	SlackAPIItemCallback *item;
+	const char *list;
 	gpointer data;
+	GDestroyNotify data_free; /* for data, if dropped by slack_api_close without calling back */
 };
 
-static void api_error(SlackAPICall *call, const char *error) {
-	if (call->callback)
-		call->callback(call->sa, call->data, NULL, error);
+static void api_call_free(SlackAPICall *call) {
+	g_hash_table_remove(call->sa->api_calls, call);
+	g_free(call->url);
 	g_free(call);
+}
+
+static SlackAPIBucket *api_bucket(SlackAccount *sa, const char *method, size_t len) {
+	char *name = g_strndup(method, len);
+	SlackAPIBucket *bucket = g_hash_table_lookup(sa->api_buckets, name);
+	if (bucket) {
+		g_free(name);
+		return bucket;
+	}
+
+	bucket = g_new0(SlackAPIBucket, 1);
+	bucket->name = name;
+	bucket->method = &api_method_default;
+	unsigned i;
+	for (i = 0; i < G_N_ELEMENTS(api_methods); i++)
+		if (!strcmp(api_methods[i].name, name)) {
+			bucket->method = &api_methods[i];
+			break;
+		}
+	if (bucket->method->tier)
+		bucket->tokens = api_tiers[bucket->method->tier - 1].burst;
+	bucket->updated = g_get_monotonic_time();
+	g_hash_table_insert(sa->api_buckets, name, bucket);
+	return bucket;
+}
+
+/* How long (usec) until the bucket allows another call, topping it up */
+static gint64 api_bucket_wait(SlackAPIBucket *bucket, gint64 now) {
+	if (now < bucket->blocked_until)
+		return bucket->blocked_until - now;
+	if (!bucket->method->tier)
+		return 0;
+	const struct api_tier *tier = &api_tiers[bucket->method->tier - 1];
+	bucket->tokens = MIN(tier->burst, bucket->tokens + (now - bucket->updated) * tier->per_minute / 60e6);
+	bucket->updated = now;
+	if (bucket->tokens >= 1)
+		return 0;
+	return (1 - bucket->tokens) * 60e6 / tier->per_minute + 1;
+}
+
+/* Pass the response (or error) to the call's callback and those of its
+ * waiters, all from the one parsed json, and free them. */
+static void api_finish(SlackAPICall *call, json_value *json, const char *error) {
+	SlackAccount *sa = call->sa;
+
+	/* identical calls made from here on need a fresh response */
+	if (call->pending)
+		g_hash_table_remove(sa->api_pending, call->url);
+	GSList *waiters = call->waiters;
+	call->waiters = NULL;
+
+	if (call->callback)
+		call->callback(sa, call->data, json, error);
+	api_call_free(call);
+
+	while (waiters) {
+		SlackAPICall *waiter = waiters->data;
+		if (waiter->callback)
+			waiter->callback(sa, waiter->data, json, error);
+		g_free(waiter);
+		waiters = g_slist_delete_link(waiters, waiters);
+	}
+}
+
+static void api_error(SlackAPICall *call, const char *error) {
+	api_finish(call, NULL, error);
 };
 
-static void api_cb(G_GNUC_UNUSED PurpleUtilFetchUrlData *fetch, gpointer data, const gchar *buf, gsize len, const gchar *error) {
-	SlackAPICall *call = data;
+/* Pass each element of the top-level array call->list to call->item, parsing
+ * one at a time, and return the rest of the response (with an empty list in
+ * its place) as a document of its own, or NULL if the response is malformed. */
+static GString *api_list_read(SlackAPICall *call, const gchar *buf, gsize len) {
+	SlackAccount *sa = call->sa;
+	GString *head = g_string_new("{");
+	size_t list_len = strlen(call->list);
+	json_reader reader;
+	const json_char *name, *val;
+	unsigned int name_len;
+	size_t val_len;
+	int r;
+
+	json_reader_init(&reader, buf, len);
+	if (!json_reader_enter(&reader, json_object))
+		goto fail;
+
+	while ((r = json_reader_next(&reader, &name, &name_len)) > 0) {
+		if (name_len == list_len && !memcmp(name, call->list, list_len) &&
+				json_reader_enter(&reader, json_array)) {
+			while ((r = json_reader_next(&reader, NULL, NULL)) > 0) {
+				if (!json_reader_skip(&reader, &val, &val_len))
+					goto fail;
+				json_value *item = slack_json_parse(&sa->json, val, val_len);
+				if (!item) {
+					slack_json_release(&sa->json, item);
+					purple_debug_warning("slack", "api %s: invalid element: %.*s\n", call->list, (int)val_len, val);
+					goto fail;
+				}
+				call->item(sa, call->data, item);
+				slack_json_release(&sa->json, item);
+			}
+			if (r < 0)
+				goto fail;
+			val = "[]";
+			val_len = 2;
+		} else if (!json_reader_skip(&reader, &val, &val_len))
+			goto fail;
+
+		g_string_append_c(head, '"');
+		g_string_append_len(head, name, name_len);
+		g_string_append(head, "\":");
+		g_string_append_len(head, val, val_len);
+		g_string_append_c(head, ',');
+	}
+
+	if (r < 0 || !json_reader_done(&reader))
+		goto fail;
+
+	if (head->len > 1)
+		g_string_truncate(head, head->len - 1);
+	g_string_append_c(head, '}');
+	return head;
+
+fail:
+	g_string_free(head, TRUE);
+	return NULL;
+}
 
+static void api_schedule(SlackAccount *sa);
+
+/* Put a rate limited call back at the front of its queue, and hold its
+ * method off for retry_after seconds.  FALSE if it's been retried enough. */
+static gboolean api_retry(SlackAPICall *call, unsigned retry_after) {
+	SlackAccount *sa = call->sa;
+	if (call->retries++ >= SLACK_API_RETRIES)
+		return FALSE;
+
+	sa->api_ratelimited ++;
+	retry_after = retry_after ?: SLACK_API_RETRY_AFTER;
+	purple_debug_warning("slack", "api %s rate limited, retrying in %u s\n", call->bucket->name, retry_after);
+	call->bucket->blocked_until = MAX(call->bucket->blocked_until, g_get_monotonic_time() + (gint64)retry_after * G_USEC_PER_SEC);
+	call->bucket->tokens = 0;
+	g_queue_push_head(&sa->api_queue[call->bucket->method->priority], call);
+	return TRUE;
+}
+
+static void api_response(SlackAPICall *call, const gchar *buf, gsize len, const gchar *error) {
 	purple_debug_misc("slack", "api response: %s\n", error ?: buf);
 	if (error) {
 		api_error(call, error);
 		return;
 	}
 
-	json_value *json = json_parse(buf, len);
+	SlackAccount *sa = call->sa;
+	GString *head = call->item ? api_list_read(call, buf, len) : NULL;
+	json_value *json = head
+		? slack_json_parse(&sa->json, head->str, head->len)
+		: slack_json_parse(&sa->json, buf, len);
+	if (head)
+		g_string_free(head, TRUE);
 	if (!json) {
+		slack_json_release(&sa->json, json);
 		api_error(call, "Invalid JSON response");
 		return;
 	}
 
 	if (!json_get_prop_boolean(json, "ok", FALSE)) {
 		const char *err = json_get_prop_strptr(json, "error");
-		api_error(call, err ?: "Unknown error");
-		call = NULL;
-	} else if (call->callback) {
-		call->callback(call->sa, call->data, json, NULL);
+		/* (without a status to go by, as from purple_util_fetch_url) */
+		if (g_strcmp0(err, "ratelimited") || !api_retry(call, 0))
+			api_error(call, err ?: "Unknown error");
+		slack_json_release(&sa->json, json);
+		return;
 	}
 
-	json_value_free(json);
-	g_free(call);
+	api_finish(call, json, NULL);
+	slack_json_release(&sa->json, json);
 }
 
-static GString *slack_api_encode_url(SlackAccount *sa, const char *pfx, const char *method, va_list qargs) {
-	GString *url = g_string_new(NULL);
-	g_string_printf(url, "%s/%s%s?token=%s", sa->api_url, pfx, method, sa->token);
+static void api_cb(G_GNUC_UNUSED PurpleUtilFetchUrlData *fetch, gpointer data, const gchar *buf, gsize len, const gchar *error) {
+	SlackAPICall *call = data;
+	SlackAccount *sa = call->sa;
+	call->fetch = NULL;
+	sa->api_inflight --;
+	api_response(call, buf, len, error);
+	api_schedule(sa);
+}
 
-	const char *param;
-	while ((param = va_arg(qargs, const char*))) {
-		const char *val = va_arg(qargs, const char*);
-		g_string_append_printf(url, "&%s=%s", param, purple_url_encode(val));
+static void api_pool_cb(PurpleHttpPoolRequest *req, gpointer data, int status, const gchar *body, gsize len, const gchar *error) {
+	SlackAPICall *call = data;
+	SlackAccount *sa = call->sa;
+	call->req = NULL;
+	sa->api_inflight --;
+
+	if (status == 429) {
+		char *retry_after = purple_http_pool_get_header(req, "Retry-After");
+		gboolean retried = api_retry(call, retry_after ? strtoul(retry_after, NULL, 10) : 0);
+		g_free(retry_after);
+		if (retried) {
+			api_schedule(sa);
+			return;
+		}
+	}
+
+	/* API errors come back as 200 with "ok": false, anything else is transport trouble */
+	char status_error[32];
+	if (!error && status != 200) {
+		g_snprintf(status_error, sizeof(status_error), "HTTP error %d", status);
+		error = status_error;
+	}
+	api_response(call, body, len, error);
+	api_schedule(sa);
+}
+
+static void api_send(SlackAPICall *call) {
+	SlackAccount *sa = call->sa;
+	SlackAPIQueueStats *stats = &sa->api_stats[call->bucket->method->priority];
+
+	gint64 wait = g_get_monotonic_time() - call->queued;
+	stats->sent ++;
+	stats->wait_usec += wait;
+	stats->max_wait_usec = MAX(stats->max_wait_usec, wait);
+	sa->api_inflight ++;
+
+	/* call->url is the method's url, then '?' and the form to post */
+	gsize url_len = strcspn(call->url, "?");
+	const char *form = call->url[url_len] ? call->url + url_len + 1 : "";
+	gsize form_len = strlen(form);
+	char *url = g_strndup(call->url, url_len);
+
+	purple_debug_misc("slack", "api call: %s\n", call->url);
+	if (sa->http && (call->req = purple_http_pool_request(sa->http, "POST", url,
+					sa->api_headers, form, form_len, SLACK_API_MAX_LEN, api_pool_cb, call))) {
+		g_free(url);
+		return;
 	}
 
+	/* purple_util_fetch_url only does GETs by itself */
+	const char *host = strstr(url, "://");
+	host = host ? host + 3 : url;
+	gsize host_len = strcspn(host, "/");
+	GString *request = g_string_sized_new(128 + url_len + strlen(sa->api_headers) + form_len);
+	g_string_printf(request, "\
+POST /%s HTTP/1.1\r\n\
+Host: %.*s\r\n\
+Connection: close\r\n\
+%s\
+Content-Length: %" G_GSIZE_FORMAT "\r\n\r\n", host[host_len] ? host + host_len + 1 : "", (int)host_len, host, sa->api_headers, form_len);
+	g_string_append_len(request, form, form_len);
+	call->fetch = purple_util_fetch_url_request_len_with_account(sa->account,
+			url, TRUE, NULL, TRUE, request->str, FALSE, SLACK_API_MAX_LEN,
+			api_cb, call);
+	g_string_free(request, TRUE);
+	g_free(url);
+}
+
+static gboolean api_timer_cb(gpointer data) {
+	SlackAccount *sa = data;
+	sa->api_timer = 0;
+	api_schedule(sa);
+	return FALSE;
+}
+
+/* Send queued calls, interactive ones first, as far as their methods'
+ * buckets and the in-flight cap allow, and set a timer for the rest. */
+static void api_schedule(SlackAccount *sa) {
+	gint64 now = g_get_monotonic_time();
+	gint64 next = G_MAXINT64; /* until a waiting call's bucket allows it */
+	unsigned p;
+
+	for (p = 0; p < SLACK_API_PRIORITIES; p++) {
+		unsigned slots = p == SLACK_API_INTERACTIVE ? SLACK_API_INFLIGHT : SLACK_API_INFLIGHT - 1;
+		GQueue *queue = &sa->api_queue[p];
+		GList *l = queue->head;
+		while (l && sa->api_inflight < slots) {
+			GList *n = l->next;
+			SlackAPICall *call = l->data;
+			gint64 wait = api_bucket_wait(call->bucket, now);
+			if (wait)
+				next = MIN(next, wait);
+			else {
+				if (call->bucket->method->tier)
+					call->bucket->tokens -= 1;
+				g_queue_delete_link(queue, l);
+				api_send(call);
+			}
+			l = n;
+		}
+	}
+
+	if (sa->api_timer) {
+		purple_timeout_remove(sa->api_timer);
+		sa->api_timer = 0;
+	}
+	if (next < G_MAXINT64)
+		sa->api_timer = purple_timeout_add(next / 1000 + 1, api_timer_cb, sa);
+}
+
+/* Append param=val to a form (following a url and '?'), percent-encoding
+ * val straight into room for the worst case. */
+static void api_form_append(GString *form, const char *param, const char *val) {
+	static const char hex[] = "0123456789ABCDEF";
+	gsize len = form->len, param_len = strlen(param), val_len = strlen(val);
+	gboolean sep = len && form->str[len-1] != '?';
+
+	g_string_set_size(form, len + sep + param_len + 1 + 3*val_len);
+	char *p = form->str + len;
+	if (sep)
+		*p++ = '&';
+	memcpy(p, param, param_len);
+	p += param_len;
+	*p++ = '=';
+	for (; *val; val++) {
+		guchar c = *val;
+		if (g_ascii_isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~')
+			*p++ = c;
+		else {
+			*p++ = '%';
+			*p++ = hex[c >> 4];
+			*p++ = hex[c & 15];
+		}
+	}
+	g_string_truncate(form, p - form->str);
+}
+
+/* The method's url, then '?' and the form-encoded params (see api_send),
+ * with extra bytes to spare */
+static GString *slack_api_encode_url(SlackAccount *sa, const char *pfx, const char *method, gsize extra, va_list qargs) {
+	/* size it for the params all needing escaping */
+	gsize len = strlen(sa->api_url) + 1 + strlen(pfx) + strlen(method) + 1 + extra;
+	const char *param;
+	va_list sizing;
+	va_copy(sizing, qargs);
+	while ((param = va_arg(sizing, const char*)))
+		len += strlen(param) + 2 + 3*strlen(va_arg(sizing, const char*));
+	va_end(sizing);
+
+	GString *url = g_string_sized_new(len);
+	g_string_append(url, sa->api_url);
+	g_string_append_c(url, '/');
+	g_string_append(url, pfx);
+	g_string_append(url, method);
+	g_string_append_c(url, '?');
+
+	while ((param = va_arg(qargs, const char*)))
+		api_form_append(url, param, va_arg(qargs, const char*));
+
 	return url;
 }
 
-static void slack_api_call_url(SlackAccount *sa, SlackAPICallback callback, gpointer user_data, const char *url) {
+static SlackAPICall *slack_api_call_new(SlackAccount *sa, SlackAPICallback callback, gpointer user_data, GDestroyNotify data_free) {
 	SlackAPICall *call = g_new0(SlackAPICall, 1);
 	call->sa = sa;
 	call->callback = callback;
 	call->data = user_data;
+	call->data_free = data_free;
+	return call;
+}
 
-	purple_debug_misc("slack", "api call: %s\n", url);
-	call->fetch = purple_util_fetch_url_request_len_with_account(sa->account,
-			url, TRUE, NULL, TRUE, NULL, FALSE, 4096*1024,
-			api_cb, call);
+static void slack_api_call_url(SlackAPICall *call, const char *url) {
+	SlackAccount *sa = call->sa;
+
+	/* the method is the path after the api url */
+	const char *method = url + strlen(sa->api_url) + 1;
+	call->bucket = api_bucket(sa, method, strcspn(method, "?"));
+
+	if (call->bucket->method->coalesce && !call->item) {
+		SlackAPICall *pending = g_hash_table_lookup(sa->api_pending, url);
+		if (pending) {
+			purple_debug_misc("slack", "api call: %s (coalesced)\n", url);
+			pending->waiters = g_slist_append(pending->waiters, call);
+			sa->api_coalesced ++;
+			return;
+		}
+		call->url = g_strdup(url);
+		call->pending = TRUE;
+		g_hash_table_insert(sa->api_pending, call->url, call);
+	} else
+		call->url = g_strdup(url);
+	call->queued = g_get_monotonic_time();
+	g_hash_table_insert(sa->api_calls, call, call);
+
+	GQueue *queue = &sa->api_queue[call->bucket->method->priority];
+	g_queue_push_tail(queue, call);
+	SlackAPIQueueStats *stats = &sa->api_stats[call->bucket->method->priority];
+	stats->peak = MAX(stats->peak, queue->length);
+	api_schedule(sa);
+}
+
+static void api_call_va(SlackAccount *sa, SlackAPICallback callback, gpointer user_data, GDestroyNotify data_free, const char *method, va_list qargs) {
+	GString *url = slack_api_encode_url(sa, "", method, 0, qargs);
+	slack_api_call_url(slack_api_call_new(sa, callback, user_data, data_free), url->str);
+	g_string_free(url, TRUE);
 }
 
 void slack_api_call(SlackAccount *sa, SlackAPICallback callback, gpointer user_data, const char *method, ...)
 {
 	va_list qargs;
 	va_start(qargs, method);
-	GString *url = slack_api_encode_url(sa, "", method, qargs);
+	api_call_va(sa, callback, user_data, NULL, method, qargs);
+	va_end(qargs);
+}
+
+void slack_api_call_full(SlackAccount *sa, SlackAPICallback callback, gpointer user_data, GDestroyNotify data_free, const char *method, ...)
+{
+	va_list qargs;
+	va_start(qargs, method);
+	api_call_va(sa, callback, user_data, data_free, method, qargs);
 	va_end(qargs);
+}
 
-	slack_api_call_url(sa, callback, user_data, url->str);
-	g_string_free(url, TRUE);
+/* A call whose top-level array "list" is parsed and passed to item element
+ * by element, callback then getting the rest of the response. */
+static void api_list_call_url(SlackAccount *sa, SlackAPICallback *callback, SlackAPIItemCallback *item, const char *list, gpointer user_data, GDestroyNotify data_free, const char *url) {
+	SlackAPICall *call = slack_api_call_new(sa, callback, user_data, data_free);
+	call->item = item;
+	call->list = list;
+	slack_api_call_url(call, url);
 }
 
-gboolean slack_api_channel_call(SlackAccount *sa, SlackAPICallback callback, gpointer user_data, SlackObject *obj, const char *method, ...) {
+typedef struct _SlackAPIPager {
+	SlackAPICallback *callback;
+	SlackAPIItemCallback *item;
+	const char *list;
+	gpointer data;
+	const char *progress;
+	int step;
+	GString *url; /* first page, to which each cursor is appended */
+	gsize url_len;
+	unsigned count; /* items so far */
+} SlackAPIPager;
+
+static void api_pager_free(gpointer data) {
+	SlackAPIPager *pager = data;
+	g_string_free(pager->url, TRUE);
+	g_free(pager);
+}
+
+static void api_page_item(SlackAccount *sa, gpointer data, json_value *json) {
+	SlackAPIPager *pager = data;
+	pager->count ++;
+	pager->item(sa, pager->data, json);
+}
+
+static void api_page_get(SlackAccount *sa, SlackAPIPager *pager);
+
+static void api_page_cb(SlackAccount *sa, gpointer data, json_value *json, const char *error) {
+	SlackAPIPager *pager = data;
+
+	const char *cursor = error ? NULL : json_get_prop_strptr(json_get_prop(json, "response_metadata"), "next_cursor");
+	if (cursor && *cursor) {
+		if (pager->progress && sa->gc->state == PURPLE_CONNECTING) {
+			char *msg = g_strdup_printf("%s (%u)", pager->progress, pager->count);
+			purple_connection_update_progress(sa->gc, msg, pager->step, SLACK_CONNECT_STEPS);
+			g_free(msg);
+		}
+		g_string_truncate(pager->url, pager->url_len);
+		api_form_append(pager->url, "cursor", cursor);
+		api_page_get(sa, pager);
+		return;
+	}
+
+	if (pager->callback)
+		pager->callback(sa, pager->data, json, error);
+	api_pager_free(pager);
+}
+
+static void api_page_get(SlackAccount *sa, SlackAPIPager *pager) {
+	api_list_call_url(sa, api_page_cb, api_page_item, pager->list, pager, api_pager_free, pager->url->str);
+}
+
+void slack_api_paged_call(SlackAccount *sa, SlackAPICallback callback, SlackAPIItemCallback item, const char *list, gpointer user_data, const char *progress, int step, const char *method, ...)
+{
+	va_list qargs;
+	va_start(qargs, method);
+	GString *url = slack_api_encode_url(sa, "", method, 0, qargs);
+	va_end(qargs);
+
+	if (progress && sa->gc->state == PURPLE_CONNECTING)
+		purple_connection_update_progress(sa->gc, progress, step, SLACK_CONNECT_STEPS);
+
+	int limit = purple_account_get_int(sa->account, "page_size", SLACK_API_PAGE_SIZE);
+	if (limit <= 0) {
+		/* the whole list in one go */
+		api_list_call_url(sa, callback, item, list, user_data, NULL, url->str);
+		g_string_free(url, TRUE);
+		return;
+	}
+	char limit_buf[16];
+	g_snprintf(limit_buf, sizeof(limit_buf), "%d", limit);
+	api_form_append(url, "limit", limit_buf);
+
+	SlackAPIPager *pager = g_new0(SlackAPIPager, 1);
+	pager->callback = callback;
+	pager->item = item;
+	pager->list = list;
+	pager->data = user_data;
+	pager->progress = progress;
+	pager->step = step;
+	pager->url = url;
+	pager->url_len = url->len;
+	api_page_get(sa, pager);
+}
+
+gboolean slack_api_channel_call(SlackAccount *sa, SlackAPICallback callback, gpointer user_data, GDestroyNotify data_free, SlackObject *obj, const char *method, ...) {
 	g_return_val_if_fail(obj, FALSE);
 	const char *type = NULL, *id = NULL;
 	if (SLACK_IS_CHANNEL(obj)) {
@@ -122,11 +650,99 @@ gboolean slack_api_channel_call(SlackAccount *sa, SlackAPICallback callback, gpo
 
 	va_list qargs;
 	va_start(qargs, method);
-	GString *url = slack_api_encode_url(sa, type, method, qargs);
+	GString *url = slack_api_encode_url(sa, type, method, 10 + 3*strlen(id), qargs);
 	va_end(qargs);
-	g_string_append_printf(url, "&channel=%s", purple_url_encode(id));
+	api_form_append(url, "channel", id);
 
-	slack_api_call_url(sa, callback, user_data, url->str);
+	slack_api_call_url(slack_api_call_new(sa, callback, user_data, data_free), url->str);
 	g_string_free(url, TRUE);
 	return TRUE;
 }
+
+void slack_api_close(SlackAccount *sa) {
+	GHashTableIter iter;
+	gpointer key;
+	g_hash_table_iter_init(&iter, sa->api_calls);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		SlackAPICall *call = key;
+		if (call->fetch)
+			purple_util_fetch_url_cancel(call->fetch);
+		if (call->req)
+			purple_http_pool_cancel(call->req);
+		/* (callbacks can't be trusted with a connection going away, so just free what they'd own) */
+		GSList *l;
+		for (l = call->waiters; l; l = l->next) {
+			SlackAPICall *waiter = l->data;
+			if (waiter->data_free)
+				waiter->data_free(waiter->data);
+		}
+		g_slist_free_full(call->waiters, g_free);
+		if (call->data_free)
+			call->data_free(call->data);
+		g_free(call->url);
+		g_free(call);
+	}
+	g_hash_table_destroy(sa->api_calls);
+	sa->api_calls = NULL;
+	g_hash_table_destroy(sa->api_pending);
+	sa->api_pending = NULL;
+
+	unsigned i;
+	for (i = 0; i < SLACK_API_PRIORITIES; i++)
+		g_queue_clear(&sa->api_queue[i]);
+	if (sa->api_timer) {
+		purple_timeout_remove(sa->api_timer);
+		sa->api_timer = 0;
+	}
+	g_hash_table_destroy(sa->api_buckets);
+	sa->api_buckets = NULL;
+	g_free(sa->api_headers);
+	sa->api_headers = NULL;
+
+	if (sa->http) {
+		purple_http_pool_destroy(sa->http);
+		sa->http = NULL;
+	}
+}
+
+static const char *const api_priority_names[SLACK_API_PRIORITIES] = { "interactive", "background" };
+
+void slack_api_report(SlackAccount *sa) {
+	unsigned p;
+	for (p = 0; p < SLACK_API_PRIORITIES; p++) {
+		const SlackAPIQueueStats *q = &sa->api_stats[p];
+		purple_debug_info("slack", "API %s: %" G_GUINT64_FORMAT " calls, waited %.1f ms on average, %.1f ms at most, %u queued at most\n",
+				api_priority_names[p], q->sent, q->sent ? q->wait_usec / 1e3 / q->sent : 0, q->max_wait_usec / 1e3, q->peak);
+	}
+	purple_debug_info("slack", "API: rate limited %" G_GUINT64_FORMAT " times, %" G_GUINT64_FORMAT " calls coalesced\n", sa->api_ratelimited, sa->api_coalesced);
+
+	if (!sa->http)
+		return;
+	const PurpleHttpPoolStats *stats = purple_http_pool_get_stats(sa->http);
+	purple_debug_info("slack", "API: %" G_GUINT64_FORMAT " requests on %" G_GUINT64_FORMAT " connections (%" G_GUINT64_FORMAT " reused, %" G_GUINT64_FORMAT " retried, %" G_GUINT64_FORMAT " failed), %" G_GUINT64_FORMAT " bytes received\n",
+			stats->requests, stats->connects, stats->reused, stats->retried, stats->failed, stats->bytes_in);
+}
+
+char *slack_api_info(SlackAccount *sa) {
+	GString *info = g_string_new(NULL);
+	unsigned p;
+
+	for (p = 0; p < SLACK_API_PRIORITIES; p++) {
+		const SlackAPIQueueStats *q = &sa->api_stats[p];
+		g_string_append_printf(info, "<b>API %s:</b> %u queued (at most %u), %" G_GUINT64_FORMAT " sent, waited %.1f ms on average, %.1f ms at most<br>",
+				api_priority_names[p], sa->api_queue[p].length, q->peak, q->sent,
+				q->sent ? q->wait_usec / 1e3 / q->sent : 0, q->max_wait_usec / 1e3);
+	}
+	g_string_append_printf(info, "<b>API rate limited:</b> %" G_GUINT64_FORMAT " times, %u in flight<br>", sa->api_ratelimited, sa->api_inflight);
+	g_string_append_printf(info, "<b>API calls coalesced:</b> %" G_GUINT64_FORMAT "<br>", sa->api_coalesced);
+
+	if (!sa->http)
+		g_string_append(info, "<b>API:</b> a new connection per call<br>");
+	else {
+		const PurpleHttpPoolStats *stats = purple_http_pool_get_stats(sa->http);
+		g_string_append_printf(info, "<b>API:</b> %" G_GUINT64_FORMAT " requests on %" G_GUINT64_FORMAT " connections (%" G_GUINT64_FORMAT " reused), %u open, %u queued<br>",
+				stats->requests, stats->connects, stats->reused, stats->conns, stats->queued);
+	}
+
+	return g_string_free(info, FALSE);
+}
@@ -7,10 +7,31 @@
 
 PurpleConnectionError slack_api_connection_error(const gchar *error);
 
+void slack_api_init(SlackAccount *sa);
+/* Drop all calls in flight, without calling back (but freeing their data_free user_data) */
+void slack_api_close(SlackAccount *sa);
+void slack_api_report(SlackAccount *sa);
+char *slack_api_info(SlackAccount *sa);
+
+/* default items per page of paged list calls ("page_size" setting), the most Slack allows */
+#define SLACK_API_PAGE_SIZE 1000
+
 typedef struct _SlackAPICall SlackAPICall;
 typedef void SlackAPICallback(SlackAccount *sa, gpointer user_data, json_value *json, const char *error);
+typedef void SlackAPIItemCallback(SlackAccount *sa, gpointer user_data, json_value *item);
 
 void slack_api_call(SlackAccount *sa, SlackAPICallback *callback, gpointer user_data, const char *method, /* const char *query_param1, const char *query_value1, */ ...) G_GNUC_NULL_TERMINATED;
-gboolean slack_api_channel_call(SlackAccount *sa, SlackAPICallback callback, gpointer user_data, SlackObject *obj, const char *method, ...) G_GNUC_NULL_TERMINATED;
+/* Like slack_api_call, for a user_data owned by the call: the callback frees it, or, if the call is dropped by slack_api_close, data_free does */
+void slack_api_call_full(SlackAccount *sa, SlackAPICallback *callback, gpointer user_data, GDestroyNotify data_free, const char *method, ...) G_GNUC_NULL_TERMINATED;
+/* Like slack_api_call, but the elements of the response's top-level array
+ * "list" are parsed and passed to item one by one.  The list is fetched a
+ * page at a time (of the "page_size" account setting, or all at once if 0),
+ * following response_metadata.next_cursor, so item sees each page as it
+ * arrives, and callback then gets the rest of the last response (with an
+ * empty list), or the first error.  If progress is set, it is reported
+ * (while connecting), with the count so far, as connection step. */
+void slack_api_paged_call(SlackAccount *sa, SlackAPICallback *callback, SlackAPIItemCallback *item, const char *list, gpointer user_data, const char *progress, int step, const char *method, ...) G_GNUC_NULL_TERMINATED;
+/* data_free as for slack_api_call_full */
+gboolean slack_api_channel_call(SlackAccount *sa, SlackAPICallback callback, gpointer user_data, GDestroyNotify data_free, SlackObject *obj, const char *method, ...) G_GNUC_NULL_TERMINATED;
 
 #endif
@@ -98,7 +98,7 @@ static void get_history_cb(PurpleBlistNode *buddy, PurpleRequestFields *fields)
 	SlackObject *obj = slack_blist_node_get_obj(buddy, &sa);
 	g_return_if_fail(obj);
 
-	slack_get_history(sa, obj, NULL, purple_request_fields_get_integer(fields, "count"));
+	slack_get_history(sa, obj, 0, purple_request_fields_get_integer(fields, "count"));
 }
 
 static void get_history_prompt(PurpleBlistNode *buddy) {
@@ -204,7 +204,7 @@ void slack_roomlist_expand_category(PurpleRoomlist *list, PurpleRoomlistRoom *pa
 	else
 		return;
 	purple_roomlist_ref(list);
-	slack_api_call(sa, roomlist_cb, expand, op, "exclude_archived", expand->archived ? "false" : "true", "exclude_members", "true", NULL);
+	slack_api_call_full(sa, roomlist_cb, expand, (GDestroyNotify)free_roomlist_expand, op, "exclude_archived", expand->archived ? "false" : "true", "exclude_members", "true", NULL);
 }
 
 PurpleRoomlist *slack_roomlist_get_list(PurpleConnection *gc) {
@@ -48,12 +48,34 @@ static void channel_depart(SlackAccount *sa, SlackChannel *chan) {
 	}
 }
 
+struct channel_json {
+	const char *id;
+	const char *name;
+	gboolean is_archived;
+	gboolean is_mpim;
+	gboolean is_group;
+	gboolean is_member;
+	gboolean is_channel;
+};
+
+static const SlackJsonField channel_fields[] = {
+	SLACK_JSON_FIELD(struct channel_json, id,          "id",          STRING),
+	SLACK_JSON_FIELD(struct channel_json, name,        "name",        STRING),
+	SLACK_JSON_FIELD(struct channel_json, is_archived, "is_archived", BOOLEAN),
+	SLACK_JSON_FIELD(struct channel_json, is_mpim,     "is_mpim",     BOOLEAN),
+	SLACK_JSON_FIELD(struct channel_json, is_group,    "is_group",    BOOLEAN),
+	SLACK_JSON_FIELD(struct channel_json, is_member,   "is_member",   BOOLEAN),
+	SLACK_JSON_FIELD(struct channel_json, is_channel,  "is_channel",  BOOLEAN),
+};
+static SlackJsonSchema channel_schema = SLACK_JSON_SCHEMA(channel_fields);
+
 static SlackChannel *channel_update(SlackAccount *sa, json_value *json, SlackChannelType type) {
+	struct channel_json c = { NULL };
 	const char *sid = json_get_strptr(json);
 	if (sid)
 		json = NULL;
-	else
-		sid = json_get_prop_strptr(json, "id");
+	else if (slack_json_decode(&channel_schema, json, &c))
+		sid = c.id;
 	if (!sid)
 		return NULL;
 	slack_object_id id;
@@ -61,15 +83,15 @@ static SlackChannel *channel_update(SlackAccount *sa, json_value *json, SlackCha
 
 	SlackChannel *chan = g_hash_table_lookup(sa->channels, id);
 
-	     if (json_get_prop_boolean(json, "is_archived", FALSE))
+	     if (c.is_archived)
 		type = SLACK_CHANNEL_DELETED;
-	else if (json_get_prop_boolean(json, "is_mpim", FALSE))
+	else if (c.is_mpim)
 		type = SLACK_CHANNEL_MPIM;
-	else if (json_get_prop_boolean(json, "is_group", FALSE))
+	else if (c.is_group)
 		type = SLACK_CHANNEL_GROUP;
-	else if (json_get_prop_boolean(json, "is_member", FALSE))
+	else if (c.is_member)
 		type = SLACK_CHANNEL_MEMBER;
-	else if (json_get_prop_boolean(json, "is_channel", FALSE))
+	else if (c.is_channel)
 		type = SLACK_CHANNEL_PUBLIC;
 
 	if (type == SLACK_CHANNEL_DELETED) {
@@ -93,7 +115,7 @@ static SlackChannel *channel_update(SlackAccount *sa, json_value *json, SlackCha
 	if (type > SLACK_CHANNEL_UNKNOWN)
 		chan->type = type;
 
-	const char *name = json_get_prop_strptr(json, "name");
+	const char *name = c.name;
 
 	if (name && g_strcmp0(chan->name, name)) {
 		purple_debug_misc("slack", "channel %s: %s %d\n", sid, name, type);
@@ -132,43 +154,51 @@ void slack_channel_update(SlackAccount *sa, json_value *json, SlackChannelType e
 	channel_update(sa, json_get_prop(json, "channel"), event);
 }
 
+static void channels_list_item(SlackAccount *sa, gpointer data, json_value *json) {
+	channel_update(sa, json, SLACK_CHANNEL_PUBLIC);
+}
+
 static void channels_list_cb(SlackAccount *sa, gpointer data, json_value *json, const char *error) {
-	json_value *chans = json_get_prop_type(json, "channels", array);
-	if (!chans) {
-		purple_connection_error_reason(sa->gc,
-				PURPLE_CONNECTION_ERROR_NETWORK_ERROR, error ?: "Missing channel list");
+	if (!json_get_prop_type(json, "channels", array)) {
+		if (PURPLE_CONNECTION_IS_CONNECTED(sa->gc))
+			slack_rtm_reload_done(sa, error ?: "Missing channel list");
+		else
+			purple_connection_error_reason(sa->gc,
+					PURPLE_CONNECTION_ERROR_NETWORK_ERROR, error ?: "Missing channel list");
 		return;
 	}
 
-	g_hash_table_remove_all(sa->channels);
-	for (unsigned i = 0; i < chans->u.array.length; i++)
-		channel_update(sa, chans->u.array.values[i], SLACK_CHANNEL_PUBLIC);
-
 	slack_groups_load(sa);
 }
 
+static void groups_list_item(SlackAccount *sa, gpointer data, json_value *json) {
+	channel_update(sa, json, SLACK_CHANNEL_GROUP);
+}
+
 static void groups_list_cb(SlackAccount *sa, gpointer data, json_value *json, const char *error) {
-	json_value *chans = json_get_prop_type(json, "groups", array);
-	if (!chans) {
-		purple_connection_error_reason(sa->gc,
-				PURPLE_CONNECTION_ERROR_NETWORK_ERROR, error ?: "Missing group list");
+	if (!json_get_prop_type(json, "groups", array)) {
+		if (PURPLE_CONNECTION_IS_CONNECTED(sa->gc))
+			slack_rtm_reload_done(sa, error ?: "Missing group list");
+		else
+			purple_connection_error_reason(sa->gc,
+					PURPLE_CONNECTION_ERROR_NETWORK_ERROR, error ?: "Missing group list");
 		return;
 	}
 
-	for (unsigned i = 0; i < chans->u.array.length; i++)
-		channel_update(sa, chans->u.array.values[i], SLACK_CHANNEL_GROUP);
-
-	purple_connection_set_state(sa->gc, PURPLE_CONNECTED);
+	if (PURPLE_CONNECTION_IS_CONNECTED(sa->gc))
+		slack_rtm_reload_done(sa, NULL);
+	else
+		purple_connection_set_state(sa->gc, PURPLE_CONNECTED);
 }
 
 void slack_channels_load(SlackAccount *sa) {
-	purple_connection_update_progress(sa->gc, "Loading Channels", 6, SLACK_CONNECT_STEPS);
-	slack_api_call(sa, channels_list_cb, NULL, "channels.list", "exclude_archived", "true", "exclude_members", "true", NULL);
+	if (!PURPLE_CONNECTION_IS_CONNECTED(sa->gc))
+		g_hash_table_remove_all(sa->channels);
+	slack_api_paged_call(sa, channels_list_cb, channels_list_item, "channels", NULL, "Loading Channels", 6, "channels.list", "exclude_archived", "true", "exclude_members", "true", NULL);
 }
 
 void slack_groups_load(SlackAccount *sa) {
-	purple_connection_update_progress(sa->gc, "Loading Groups", 7, SLACK_CONNECT_STEPS);
-	slack_api_call(sa, groups_list_cb, NULL, "groups.list", "exclude_archived", "true", NULL);
+	slack_api_paged_call(sa, groups_list_cb, groups_list_item, "groups", NULL, "Loading Groups", 7, "groups.list", "exclude_archived", "true", NULL);
 }
 
 struct join_channel {
@@ -227,7 +257,7 @@ static void channels_info_cb(SlackAccount *sa, gpointer data, json_value *json,
 
 	if (purple_account_get_bool(sa->account, "get_history", FALSE)) {
 		slack_get_history(sa, &chan->object,
-				json_get_prop_strptr(json, "last_read"),
+				slack_parse_ts(json_get_prop(json, "last_read")),
 				json_get_prop_val(json, "unread_count", integer, 0));
 	}
 }
@@ -284,7 +314,7 @@ void slack_join_chat(PurpleConnection *gc, GHashTable *info) {
 	if (chan && chan->type >= SLACK_CHANNEL_MEMBER)
 		channels_join_cb(sa, join, NULL, NULL);
 	else
-		slack_api_call(sa, channels_join_cb, join, "channels.join", "name", name, NULL);
+		slack_api_call_full(sa, channels_join_cb, join, (GDestroyNotify)join_channel_free, "channels.join", "name", name, NULL);
 }
 
 void slack_chat_leave(PurpleConnection *gc, int cid) {
@@ -318,7 +348,7 @@ static void send_chat_cb(SlackAccount *sa, gpointer data, json_value *json, cons
 	}
 
 	char *html = slack_message_to_html(sa, json_get_prop_strptr(json, "text"), NULL, &send->flags);
-	time_t mt = slack_parse_time(json_get_prop(json, "ts"));
+	time_t mt = slack_ts_time(slack_parse_ts(json_get_prop(json, "ts")));
 	serv_got_chat_in(sa->gc, send->cid, purple_connection_get_display_name(sa->gc), send->flags, html, mt);
 	send_chat_free(send);
 	g_free(html);
@@ -341,11 +371,12 @@ int slack_chat_send(PurpleConnection *gc, int cid, const char *msg, PurpleMessag
 	send->cid = cid;
 	send->flags = flags;
 
-	GString *channel = append_json_string(g_string_new(NULL), chan->object.id);
-	GString *text = append_json_string(g_string_new(NULL), m);
-	slack_rtm_send(sa, send_chat_cb, send, "message", "channel", channel->str, "text", text->str, NULL);
-	g_string_free(channel, TRUE);
-	g_string_free(text, TRUE);
+	SlackJsonWriter *w = slack_rtm_begin(sa, "message");
+	slack_json_key(w, "channel");
+	slack_json_string(w, chan->object.id);
+	slack_json_key(w, "text");
+	slack_json_string(w, m);
+	slack_rtm_send(sa, send_chat_cb, send);
 	g_free(m);
 
 	return 1;
@@ -11,32 +11,41 @@
 #include "slack-channel.h"
 #include "slack-im.h"
 
-static void slack_presence_sub(SlackAccount *sa) {
-	GString *ids = g_string_new("[");
+void slack_presence_sub(SlackAccount *sa) {
+	SlackJsonWriter *w = slack_rtm_begin(sa, "presence_sub");
+	slack_json_key(w, "ids");
+	slack_json_begin_array(w);
 	GHashTableIter iter;
 	gpointer id;
 	SlackUser *user;
 	g_hash_table_iter_init(&iter, sa->ims);
-	gboolean first = TRUE;
-	while (g_hash_table_iter_next(&iter, &id, (gpointer*)&user)) {
-		if (first)
-			first = FALSE;
-		else
-			g_string_append_c(ids, ',');
-		append_json_string(ids, user->object.id);
-	}
-	g_string_append_c(ids, ']');
+	while (g_hash_table_iter_next(&iter, &id, (gpointer*)&user))
+		slack_json_string(w, user->object.id);
+	slack_json_end_array(w);
 
-	slack_rtm_send(sa, NULL, NULL, "presence_sub", "ids", ids->str, NULL);
-	g_string_free(ids, TRUE);
+	slack_rtm_send(sa, NULL, NULL);
 }
 
+struct im_json {
+	const char *id;
+	gboolean is_open;
+	const char *user;
+};
+
+static const SlackJsonField im_fields[] = {
+	SLACK_JSON_FIELD(struct im_json, id,      "id",      STRING),
+	SLACK_JSON_FIELD(struct im_json, is_open, "is_open", BOOLEAN),
+	SLACK_JSON_FIELD(struct im_json, user,    "user",    STRING),
+};
+static SlackJsonSchema im_schema = SLACK_JSON_SCHEMA(im_fields);
+
 static gboolean im_update(SlackAccount *sa, json_value *json, const json_value *open_user) {
+	struct im_json im = { .is_open = open_user != NULL };
 	const char *sid = json_get_strptr(json);
-	if (sid)
-		json = NULL;
-	else
-		sid = json_get_prop_strptr(json, "id");
+	if (!sid) {
+		slack_json_decode(&im_schema, json, &im);
+		sid = im.id;
+	}
 	if (!sid)
 		return FALSE;
 	slack_object_id id;
@@ -44,7 +53,7 @@ static gboolean im_update(SlackAccount *sa, json_value *json, const json_value *
 
 	SlackUser *user = g_hash_table_lookup(sa->ims, id);
 
-	if (!json_get_prop_boolean(json, "is_open", open_user != NULL)) {
+	if (!im.is_open) {
 		if (!user)
 			return FALSE;
 		g_return_val_if_fail(*user->im, FALSE);
@@ -60,7 +69,7 @@ static gboolean im_update(SlackAccount *sa, json_value *json, const json_value *
 
 	gboolean changed = FALSE;
 
-	const char *user_id = json_get_prop_strptr(json, "user") ?: json_get_strptr(open_user);
+	const char *user_id = im.user ?: json_get_strptr(open_user);
 	g_return_val_if_fail(user_id, FALSE);
 
 	if (!user) {
@@ -106,26 +115,29 @@ void slack_im_open(SlackAccount *sa, json_value *json) {
 		slack_presence_sub(sa);
 }
 
+static void im_list_item(SlackAccount *sa, gpointer data, json_value *json) {
+	im_update(sa, json, &json_value_none);
+}
+
 static void im_list_cb(SlackAccount *sa, gpointer data, json_value *json, const char *error) {
-	json_value *ims = json_get_prop_type(json, "ims", array);
-	if (!ims) {
-		purple_connection_error_reason(sa->gc,
-				PURPLE_CONNECTION_ERROR_NETWORK_ERROR, error ?: "Missing IM channel list");
+	if (!json_get_prop_type(json, "ims", array)) {
+		if (PURPLE_CONNECTION_IS_CONNECTED(sa->gc))
+			slack_rtm_reload_done(sa, error ?: "Missing IM channel list");
+		else
+			purple_connection_error_reason(sa->gc,
+					PURPLE_CONNECTION_ERROR_NETWORK_ERROR, error ?: "Missing IM channel list");
 		return;
 	}
 
-	g_hash_table_remove_all(sa->ims);
-	for (unsigned i = 0; i < ims->u.array.length; i ++)
-		im_update(sa, ims->u.array.values[i], &json_value_none);
-
 	slack_presence_sub(sa);
 
 	slack_channels_load(sa);
 }
 
 void slack_ims_load(SlackAccount *sa) {
-	purple_connection_update_progress(sa->gc, "Loading IM channels", 5, SLACK_CONNECT_STEPS);
-	slack_api_call(sa, im_list_cb, NULL, "im.list", NULL);
+	if (!PURPLE_CONNECTION_IS_CONNECTED(sa->gc))
+		g_hash_table_remove_all(sa->ims);
+	slack_api_paged_call(sa, im_list_cb, im_list_item, "ims", NULL, "Loading IM channels", 5, "im.list", NULL);
 }
 
 struct send_im {
@@ -162,11 +174,12 @@ static void send_im_open_cb(SlackAccount *sa, gpointer data, json_value *json, c
 		return;
 	}
 
-	GString *channel = append_json_string(g_string_new(NULL), send->user->im);
-	GString *text = append_json_string(g_string_new(NULL), send->msg);
-	slack_rtm_send(sa, send_im_cb, send, "message", "channel", channel->str, "text", text->str, NULL);
-	g_string_free(channel, TRUE);
-	g_string_free(text, TRUE);
+	SlackJsonWriter *w = slack_rtm_begin(sa, "message");
+	slack_json_key(w, "channel");
+	slack_json_string(w, send->user->im);
+	slack_json_key(w, "text");
+	slack_json_string(w, send->msg);
+	slack_rtm_send(sa, send_im_cb, send);
 }
 
 int slack_send_im(PurpleConnection *gc, const char *who, const char *msg, PurpleMessageFlags flags) {
@@ -187,7 +200,7 @@ int slack_send_im(PurpleConnection *gc, const char *who, const char *msg, Purple
 	send->flags = flags;
 
 	if (!*user->im)
-		slack_api_call(sa, send_im_open_cb, send, "im.open", "user", user->object.id, "return_im", "true", NULL);
+		slack_api_call_full(sa, send_im_open_cb, send, (GDestroyNotify)send_im_free, "im.open", "user", user->object.id, "return_im", "true", NULL);
 	else
 		send_im_open_cb(sa, send, NULL, NULL);
 
@@ -6,6 +6,8 @@
 
 /* Initialization */
 void slack_ims_load(SlackAccount *sa);
+/* (Re)subscribe to presence of everyone we have an IM with */
+void slack_presence_sub(SlackAccount *sa);
 
 /* RTM event handlers */
 void slack_im_close(SlackAccount *sa, json_value *json);
@@ -1,46 +1,174 @@
 #include <string.h>
 
+#include <debug.h>
+
 #include "slack-json.h"
 
 json_value *json_get_prop(json_value *val, const char *index) {
    if (!val || val->type != json_object)
       return NULL;
 
-   for (unsigned int i = 0; i < val->u.object.length; ++ i)
-      if (!strcmp (val->u.object.values [i].name, index))
-         return val->u.object.values[i].value;
+   unsigned int len = strlen(index);
+   return json_object_get(val, index, len, json_hash(index, len));
+}
+
+static void schema_init(SlackJsonSchema *schema) {
+	/* (slack_json_decode tracks fields in a 32-bit mask) */
+	g_assert(schema->count <= 32);
+	unsigned mask = 7;
+	while (mask + 1 < schema->count * 2)
+		mask = (mask << 1) | 1;
+
+	unsigned *hashes = g_new(unsigned, schema->count);
+	guint8 *slots = g_new0(guint8, mask + 1);
+	for (unsigned i = 0; i < schema->count; i ++) {
+		const char *name = schema->fields[i].name;
+		hashes[i] = json_hash(name, strlen(name));
+		unsigned s = hashes[i] & mask;
+		while (slots[s])
+			s = (s + 1) & mask;
+		slots[s] = i + 1;
+	}
+
+	schema->hashes = hashes;
+	schema->slots = slots;
+	schema->mask = mask;
+}
+
+gboolean slack_json_decode(SlackJsonSchema *schema, json_value *json, gpointer out) {
+	if (!json || json->type != json_object)
+		return FALSE;
+	if (!schema->slots)
+		schema_init(schema);
+
+	guint32 seen = 0; /* only the first of duplicate members counts, as with json_get_prop */
+	for (unsigned i = 0; i < json->u.object.length; i ++) {
+		const json_object_entry *entry = &json->u.object.values[i];
+		int f = -1;
+		for (unsigned s = entry->name_hash & schema->mask; schema->slots[s]; s = (s + 1) & schema->mask) {
+			unsigned n = schema->slots[s] - 1;
+			const char *name = schema->fields[n].name;
+			if (schema->hashes[n] == entry->name_hash &&
+					!strncmp(name, entry->name, entry->name_length) && !name[entry->name_length]) {
+				f = n;
+				break;
+			}
+		}
+		if (f < 0 || seen & (1u << f))
+			continue;
+
+		const SlackJsonField *field = &schema->fields[f];
+		json_value *val = entry->value;
+		gpointer p = G_STRUCT_MEMBER_P(out, field->offset);
+		switch (field->type) {
+			case SLACK_JSON_STRING:
+				if (val->type == json_string)
+					*(char **)p = val->u.string.ptr;
+				break;
+			case SLACK_JSON_BOOLEAN:
+				if (val->type == json_boolean)
+					*(gboolean *)p = val->u.boolean;
+				break;
+			case SLACK_JSON_OBJECT:
+				if (val->type == json_object)
+					*(json_value **)p = val;
+				break;
+			case SLACK_JSON_VALUE:
+				*(json_value **)p = val;
+				break;
+		}
+		seen |= 1u << f;
+	}
+	return TRUE;
+}
+
+void slack_json_writer_init(SlackJsonWriter *w, GString *buf) {
+	w->buf = buf;
+	w->comma = FALSE;
+}
+
+static inline void writer_value(SlackJsonWriter *w) {
+	if (w->comma)
+		g_string_append_c(w->buf, ',');
+	w->comma = TRUE;
+}
+
+void slack_json_begin_object(SlackJsonWriter *w) {
+	writer_value(w);
+	g_string_append_c(w->buf, '{');
+	w->comma = FALSE;
+}
+
+void slack_json_end_object(SlackJsonWriter *w) {
+	g_string_append_c(w->buf, '}');
+	w->comma = TRUE;
+}
+
+void slack_json_begin_array(SlackJsonWriter *w) {
+	writer_value(w);
+	g_string_append_c(w->buf, '[');
+	w->comma = FALSE;
+}
 
-   return NULL;
+void slack_json_end_array(SlackJsonWriter *w) {
+	g_string_append_c(w->buf, ']');
+	w->comma = TRUE;
 }
 
-GString *append_json_string(GString *str, const char *s) {
-	g_string_append_c(str, '"');
+static void writer_escape(GString *buf, const char *s) {
+	static const char hex[] = "0123456789abcdef";
+	g_string_append_c(buf, '"');
 	const char *p = s;
-	char c;
-	for (;;) {
+	unsigned char c;
+	for (;; p++) {
 		switch ((c = *p)) {
-			case '\0':
 			case '"':
-			case '\\': break;
+			case '\\':
+				break;
 			case '\b': c = 'b'; break;
 			case '\f': c = 'f'; break;
 			case '\n': c = 'n'; break;
 			case '\r': c = 'r'; break;
 			case '\t': c = 't'; break;
 			default:
-				p++;
+				if (c >= 0x20)
+					continue;
+				if (!c)
+					break;
+				/* other control characters */
+				g_string_append_len(buf, s, p-s);
+				g_string_append(buf, "\\u00");
+				g_string_append_c(buf, hex[c >> 4]);
+				g_string_append_c(buf, hex[c & 0xf]);
+				s = p+1;
 				continue;
 		}
 
-		g_string_append_len(str, s, p-s);
+		g_string_append_len(buf, s, p-s);
 		if (!c)
 			break;
-		g_string_append_c(str, '\\');
-		g_string_append_c(str, c);
-		s = ++p;
+		g_string_append_c(buf, '\\');
+		g_string_append_c(buf, c);
+		s = p+1;
 	}
+	g_string_append_c(buf, '"');
+}
+
+void slack_json_key(SlackJsonWriter *w, const char *key) {
+	writer_value(w);
+	writer_escape(w->buf, key);
+	g_string_append_c(w->buf, ':');
+	w->comma = FALSE;
+}
+
+void slack_json_string(SlackJsonWriter *w, const char *s) {
+	writer_value(w);
+	writer_escape(w->buf, s);
+}
 
-	return g_string_append_c(str, '"');
+void slack_json_int(SlackJsonWriter *w, gint64 i) {
+	writer_value(w);
+	g_string_append_printf(w->buf, "%" G_GINT64_FORMAT, i);
 }
 
 time_t slack_parse_time(json_value *val) {
@@ -55,3 +183,108 @@ time_t slack_parse_time(json_value *val) {
 		return atol(val->u.string.ptr);
 	return 0;
 }
+
+slack_ts slack_parse_ts(json_value *val) {
+	if (!val)
+		return 0;
+	if (val->type == json_string)
+		return slack_ts_parse(val->u.string.ptr);
+	if (val->type == json_integer)
+		return val->u.integer * 1000000;
+	if (val->type == json_double)
+		return val->u.dbl * 1000000 + 0.5;
+	return 0;
+}
+
+/* size of the base chunk, which is kept across resets */
+#define SLACK_JSON_CHUNK_SIZE (64*1024)
+#define SLACK_JSON_ALIGN(n) (((n) + G_MEM_ALIGN-1) & ~(gsize)(G_MEM_ALIGN-1))
+
+struct _SlackJsonChunk {
+	struct _SlackJsonChunk *next;
+	gsize size, off;
+	/* data follows */
+};
+
+#define CHUNK_DATA(c) ((guchar *)(c) + SLACK_JSON_ALIGN(sizeof(struct _SlackJsonChunk)))
+
+static struct _SlackJsonChunk *arena_chunk_new(gsize size, struct _SlackJsonChunk *next) {
+	struct _SlackJsonChunk *chunk = g_malloc(SLACK_JSON_ALIGN(sizeof(struct _SlackJsonChunk)) + size);
+	chunk->next = next;
+	chunk->size = size;
+	chunk->off = 0;
+	return chunk;
+}
+
+static void *arena_alloc(size_t size, int zero, void *user_data) {
+	SlackJsonArena *arena = user_data;
+	struct _SlackJsonChunk *chunk = arena->chunks;
+
+	size = SLACK_JSON_ALIGN(size);
+	if (chunk->size - chunk->off < size)
+		/* oversized allocations get a chunk to themselves */
+		chunk = arena->chunks = arena_chunk_new(MAX(size, SLACK_JSON_CHUNK_SIZE), chunk);
+
+	void *p = CHUNK_DATA(chunk) + chunk->off;
+	chunk->off += size;
+	arena->used += size;
+	if (zero)
+		memset(p, 0, size);
+	return p;
+}
+
+static void arena_free(void *ptr, void *user_data) {
+	/* everything is released at once by arena_reset */
+}
+
+static void arena_reset(SlackJsonArena *arena) {
+	if (arena->used > arena->peak) {
+		arena->peak = arena->used;
+		purple_debug_info("slack", "json arena peak: %zu bytes\n", arena->peak);
+	}
+
+	struct _SlackJsonChunk *chunk;
+	while ((chunk = arena->chunks)->next) {
+		arena->chunks = chunk->next;
+		g_free(chunk);
+	}
+	chunk->off = 0;
+	arena->used = 0;
+}
+
+void slack_json_arena_init(SlackJsonArena *arena) {
+	memset(arena, 0, sizeof(*arena));
+	arena->settings.mem_alloc = arena_alloc;
+	arena->settings.mem_free = arena_free;
+	arena->settings.user_data = arena;
+	arena->settings.settings = json_index_objects;
+	arena->chunks = arena_chunk_new(SLACK_JSON_CHUNK_SIZE, NULL);
+}
+
+void slack_json_arena_destroy(SlackJsonArena *arena) {
+	g_warn_if_fail(!arena->depth);
+	struct _SlackJsonChunk *chunk;
+	while ((chunk = arena->chunks)) {
+		arena->chunks = chunk->next;
+		g_free(chunk);
+	}
+}
+
+json_value *slack_json_parse(SlackJsonArena *arena, const char *buf, size_t len) {
+	arena->depth ++;
+	return json_parse_ex(&arena->settings, buf, len, NULL);
+}
+
+json_value *slack_json_parse_in_situ(SlackJsonArena *arena, char *buf, size_t len) {
+	json_settings settings = arena->settings;
+	settings.settings |= json_in_situ;
+	arena->depth ++;
+	return json_parse_ex(&settings, buf, len, NULL);
+}
+
+void slack_json_release(SlackJsonArena *arena, json_value *json) {
+	g_return_if_fail(arena->depth);
+	/* callbacks may parse other documents before returning, so only reset at the outermost level */
+	if (!--arena->depth)
+		arena_reset(arena);
+}
@@ -3,6 +3,7 @@
 
 #include <glib.h>
 #include "json.h"
+#include "slack-object.h"
 
 #define json_get_selector(JSON, TYPE, SELECTOR, DEFAULT) ({ \
 		__typeof__(JSON) _val = (JSON); \
@@ -28,9 +29,80 @@ json_value *json_get_prop(json_value *val, const char *prop) __attribute__((pure
 #define json_get_prop_boolean(JSON, PROP, DEF) \
 	json_get_boolean(json_get_prop(JSON, PROP), DEF)
 
-/* Add an escaped, quoted json string to a GString */
-GString *append_json_string(GString *str, const char *s);
+/* Declarative decoding of objects into C structs: each field names a member
+ * and where to store it in the struct.  Members that are missing (or of the
+ * wrong type) leave the struct untouched, so it should be filled with defaults
+ * first. */
+typedef enum {
+	SLACK_JSON_STRING, /* char * (into the document) */
+	SLACK_JSON_BOOLEAN, /* gboolean */
+	SLACK_JSON_OBJECT, /* json_value * */
+	SLACK_JSON_VALUE, /* json_value *, of any type */
+} SlackJsonFieldType;
+
+typedef struct _SlackJsonField {
+	const char *name;
+	SlackJsonFieldType type;
+	size_t offset;
+} SlackJsonField;
+
+typedef struct _SlackJsonSchema {
+	const SlackJsonField *fields;
+	unsigned count;
+	/* name hash -> field table, built on first use */
+	unsigned *hashes;
+	guint8 *slots;
+	unsigned mask;
+} SlackJsonSchema;
+
+#define SLACK_JSON_FIELD(STRUCT, MEMBER, NAME, TYPE) \
+	{ NAME, SLACK_JSON_##TYPE, G_STRUCT_OFFSET(STRUCT, MEMBER) }
+#define SLACK_JSON_SCHEMA(FIELDS) \
+	{ FIELDS, G_N_ELEMENTS(FIELDS), NULL, NULL, 0 }
+
+/* Fill out from the members of json in a single pass (if it is an object) */
+gboolean slack_json_decode(SlackJsonSchema *schema, json_value *json, gpointer out);
+
+/* Streaming json writer: values are appended to buf as they are written, with
+ * commas inserted as needed and strings escaped in a single pass. */
+typedef struct _SlackJsonWriter {
+	GString *buf;
+	gboolean comma; /* a value has been written at this level */
+} SlackJsonWriter;
+
+void slack_json_writer_init(SlackJsonWriter *w, GString *buf);
+void slack_json_begin_object(SlackJsonWriter *w);
+void slack_json_end_object(SlackJsonWriter *w);
+void slack_json_begin_array(SlackJsonWriter *w);
+void slack_json_end_array(SlackJsonWriter *w);
+/* Start an object member: must be followed by its value */
+void slack_json_key(SlackJsonWriter *w, const char *key);
+void slack_json_string(SlackJsonWriter *w, const char *s);
+void slack_json_int(SlackJsonWriter *w, gint64 i);
 
 time_t slack_parse_time(json_value *val);
+/* Parse a message timestamp (normally a string, but numbers are accepted too) */
+slack_ts slack_parse_ts(json_value *val);
+
+/* Bump allocator for parsed json documents.
+ * All the values of a document are carved out of a few large chunks, and
+ * released together by resetting the arena, rather than freed node by node. */
+typedef struct _SlackJsonArena {
+	json_settings settings;
+	struct _SlackJsonChunk *chunks; /* current chunk first, base chunk last */
+	gsize used; /* bytes handed out since the last reset */
+	gsize peak; /* high-water mark of used */
+	unsigned depth; /* documents parsed and not yet released */
+} SlackJsonArena;
+
+void slack_json_arena_init(SlackJsonArena *arena);
+void slack_json_arena_destroy(SlackJsonArena *arena);
+
+/* Parse a document into the arena; must be paired with slack_json_release (even if NULL) */
+json_value *slack_json_parse(SlackJsonArena *arena, const char *buf, size_t len);
+/* Parse a document in place (see json_in_situ): buf is modified, and must outlive the result */
+json_value *slack_json_parse_in_situ(SlackJsonArena *arena, char *buf, size_t len);
+/* Release a document: the arena is reset once no documents are outstanding */
+void slack_json_release(SlackJsonArena *arena, json_value *json);
 
 #endif
@@ -159,13 +159,39 @@ gchar *slack_message_to_html(SlackAccount *sa, gchar *s, const char *subtype, Pu
 	return g_string_free(html, FALSE);
 }
 
+struct message_json {
+	const char *user;
+	const char *subtype;
+	json_value *ts;
+	gboolean hidden;
+	char *text; /* modified by slack_message_to_html */
+	const char *topic;
+};
+
+static const SlackJsonField message_fields[] = {
+	SLACK_JSON_FIELD(struct message_json, user,    "user",    STRING),
+	SLACK_JSON_FIELD(struct message_json, subtype, "subtype", STRING),
+	SLACK_JSON_FIELD(struct message_json, ts,      "ts",      VALUE),
+	SLACK_JSON_FIELD(struct message_json, hidden,  "hidden",  BOOLEAN),
+	SLACK_JSON_FIELD(struct message_json, text,    "text",    STRING),
+	SLACK_JSON_FIELD(struct message_json, topic,   "topic",   STRING),
+};
+static SlackJsonSchema message_schema = SLACK_JSON_SCHEMA(message_fields);
+
 static void handle_message(SlackAccount *sa, SlackObject *obj, json_value *json, PurpleMessageFlags flags) {
-	const char *user_id    = json_get_prop_strptr(json, "user");
-	const char *subtype    = json_get_prop_strptr(json, "subtype");
-	json_value *ts         = json_get_prop(json, "ts");
-	time_t mt = slack_parse_time(ts);
+	struct message_json m = { NULL };
+	slack_json_decode(&message_schema, json, &m);
+
+	const char *user_id    = m.user;
+	const char *subtype    = m.subtype;
+	slack_ts ts            = slack_parse_ts(m.ts);
+	time_t mt = slack_ts_time(ts);
+
+	/* where to resync from after reconnecting */
+	if (!(flags & PURPLE_MESSAGE_DELAYED) && ts > sa->last_ts)
+		sa->last_ts = ts;
 
-	if (json_get_prop_boolean(json, "hidden", FALSE))
+	if (m.hidden)
 		flags |= PURPLE_MESSAGE_INVISIBLE;
 
 	SlackUser *user = NULL;
@@ -176,7 +202,7 @@ static void handle_message(SlackAccount *sa, SlackObject *obj, json_value *json,
 #endif
 	}
 
-	char *html = slack_message_to_html(sa, json_get_prop_strptr(json, "text"), subtype, &flags);
+	char *html = slack_message_to_html(sa, m.text, subtype, &flags);
 
 	PurpleConversation *conv = NULL;
 	if (SLACK_IS_CHANNEL(obj)) {
@@ -199,7 +225,7 @@ static void handle_message(SlackAccount *sa, SlackObject *obj, json_value *json,
 			if (!subtype);
 			else if (!strcmp(subtype, "channel_topic") ||
 					!strcmp(subtype, "group_topic"))
-				purple_conv_chat_set_topic(chat, user ? user->name : user_id, json_get_prop_strptr(json, "topic"));
+				purple_conv_chat_set_topic(chat, user ? user->name : user_id, m.topic);
 		}
 
 		serv_got_chat_in(sa->gc, chan->cid, user ? user->name : user_id ?: "", flags, html, mt);
@@ -222,10 +248,8 @@ static void handle_message(SlackAccount *sa, SlackObject *obj, json_value *json,
 	g_free(html);
 
 	/* update most recent ts for later marking */
-	if (conv && json_get_strptr(ts)) {
-		g_free(purple_conversation_get_data(conv, "slack:ts"));
-		purple_conversation_set_data(conv, "slack:ts", g_strdup(json_get_strptr(ts)));
-	}
+	if (conv && ts > obj->last_ts)
+		obj->last_ts = ts;
 }
 
 void slack_message(SlackAccount *sa, json_value *json) {
@@ -263,9 +287,10 @@ unsigned int slack_send_typing(PurpleConnection *gc, const char *who, PurpleTypi
 	if (!user || !*user->im)
 		return 0;
 
-	GString *channel = append_json_string(g_string_new(NULL), user->im);
-	slack_rtm_send(sa, NULL, NULL, "typing", "channel", channel->str, NULL);
-	g_string_free(channel, TRUE);
+	SlackJsonWriter *w = slack_rtm_begin(sa, "typing");
+	slack_json_key(w, "channel");
+	slack_json_string(w, user->im);
+	slack_rtm_send(sa, NULL, NULL);
 
 	return 3;
 }
@@ -293,7 +318,7 @@ static void get_history_cb(SlackAccount *sa, gpointer data, json_value *json, co
 	g_object_unref(obj);
 }
 
-void slack_get_history(SlackAccount *sa, SlackObject *obj, const char *since, unsigned count) {
+void slack_get_history(SlackAccount *sa, SlackObject *obj, slack_ts since, unsigned count) {
 	if (SLACK_IS_CHANNEL(obj)) {
 		SlackChannel *chan = (SlackChannel*)obj;
 		if (!chan->cid)
@@ -302,7 +327,9 @@ void slack_get_history(SlackAccount *sa, SlackObject *obj, const char *since, un
 
 	char count_buf[6] = "";
 	snprintf(count_buf, 5, "%u", count);
-	slack_api_channel_call(sa, get_history_cb, g_object_ref(obj), obj, "history", "oldest", since ?: "0", "count", count_buf, NULL);
+	char since_buf[SLACK_TS_SIZ];
+	if (!slack_api_channel_call(sa, get_history_cb, g_object_ref(obj), g_object_unref, obj, "history", "oldest", since ? slack_ts_format(since, since_buf) : "0", "count", count_buf, NULL))
+		g_object_unref(obj);
 }
 
 SlackObject *slack_conversation_get_channel(SlackAccount *sa, PurpleConversation *conv) {
@@ -322,13 +349,11 @@ void slack_mark_conversation(SlackAccount *sa, PurpleConversation *conv) {
 		/* we could update read count to farther back, but best to only move it forward to latest */
 		return;
 
-	char *ts = purple_conversation_get_data(conv, "slack:ts");
-	if (!ts)
+	SlackObject *obj = slack_conversation_get_channel(sa, conv);
+	if (!obj || obj->last_ts <= obj->marked_ts)
 		return;
-	/* we don't need ts anymore */
-	purple_conversation_set_data(conv, "slack:ts", NULL);
+	obj->marked_ts = obj->last_ts;
 
-	SlackObject *obj = slack_conversation_get_channel(sa, conv);
-	slack_api_channel_call(sa, NULL, NULL, obj, "mark", "ts", ts, NULL);
-	g_free(ts);
+	char ts[SLACK_TS_SIZ];
+	slack_api_channel_call(sa, NULL, NULL, NULL, obj, "mark", "ts", slack_ts_format(obj->marked_ts, ts), NULL);
 }
@@ -8,7 +8,7 @@
 gchar *slack_html_to_message(SlackAccount *sa, const char *s, PurpleMessageFlags flags);
 gchar *slack_message_to_html(SlackAccount *sa, gchar *s, const char *subtype, PurpleMessageFlags *flags);
 SlackObject *slack_conversation_get_channel(SlackAccount *sa, PurpleConversation *conv);
-void slack_get_history(SlackAccount *sa, SlackObject *obj, const char *since, unsigned count);
+void slack_get_history(SlackAccount *sa, SlackObject *obj, slack_ts since, unsigned count);
 void slack_mark_conversation(SlackAccount *sa, PurpleConversation *conv);
 
 /* RTM event handlers */
@@ -9,6 +9,35 @@ gboolean slack_object_id_equal(gconstpointer a, gconstpointer b) {
 	return !slack_object_id_cmp(a, b);
 }
 
+slack_ts slack_ts_parse(const char *s) {
+	slack_ts sec = 0, usec = 0;
+	unsigned n;
+	if (!s)
+		return 0;
+	for (; *s >= '0' && *s <= '9'; s++)
+		sec = 10*sec + (*s - '0');
+	if (*s == '.')
+		s++;
+	for (n = 0; n < 6; n++) {
+		usec *= 10;
+		if (*s >= '0' && *s <= '9')
+			usec += *s++ - '0';
+	}
+	return 1000000*sec + usec;
+}
+
+char *slack_ts_format(slack_ts ts, char buf[SLACK_TS_SIZ]) {
+	char *p = &buf[SLACK_TS_SIZ-1];
+	*p = 0;
+	for (unsigned n = 0; n < 6; n++, ts /= 10)
+		*--p = '0' + ts % 10;
+	*--p = '.';
+	do
+		*--p = '0' + ts % 10;
+	while ((ts /= 10));
+	return memmove(buf, p, &buf[SLACK_TS_SIZ] - p);
+}
+
 G_DEFINE_ABSTRACT_TYPE(SlackObject, slack_object, G_TYPE_OBJECT);
 
 static void slack_object_class_init(SlackObjectClass *klass) {
@@ -33,6 +33,15 @@ static inline gboolean slack_object_id_is(const slack_object_id id, const char *
 	return s ? !strncmp(id, s, SLACK_OBJECT_ID_SIZ-1) : !*id;
 }
 
+/* message timestamps are of the form "EPOCH.MICROS" (which we store as EPOCH*1000000+MICROS, or 0 for none) */
+typedef guint64 slack_ts;
+#define SLACK_TS_SIZ	24
+#define slack_ts_time(ts) ((time_t)((ts) / 1000000))
+
+slack_ts slack_ts_parse(const char *s);
+/* Format ts into buf, returning buf */
+char *slack_ts_format(slack_ts ts, char buf[SLACK_TS_SIZ]);
+
 guint slack_object_id_hash(gconstpointer id);
 gboolean slack_object_id_equal(gconstpointer a, gconstpointer b);
 
@@ -40,6 +49,8 @@ struct _SlackObject {
 	GObject parent;
 
 	slack_object_id id;
+	slack_ts last_ts; /* most recent message seen */
+	slack_ts marked_ts; /* most recent message marked read */
 };
 
 #define SLACK_TYPE_OBJECT slack_object_get_type()
@@ -17,88 +17,244 @@ struct _SlackRTMCall {
 	gpointer data;
 };
 
+static void rtm_member_joined(SlackAccount *sa, json_value *json) {
+	slack_member_joined_channel(sa, json, TRUE);
+}
+
+static void rtm_member_left(SlackAccount *sa, json_value *json) {
+	slack_member_joined_channel(sa, json, FALSE);
+}
+
+static void rtm_channel_member(SlackAccount *sa, json_value *json) {
+	slack_channel_update(sa, json, SLACK_CHANNEL_MEMBER);
+}
+
+static void rtm_channel_group(SlackAccount *sa, json_value *json) {
+	slack_channel_update(sa, json, SLACK_CHANNEL_GROUP);
+}
+
+static void rtm_channel_public(SlackAccount *sa, json_value *json) {
+	slack_channel_update(sa, json, SLACK_CHANNEL_PUBLIC);
+}
+
+static void rtm_channel_unknown(SlackAccount *sa, json_value *json) {
+	slack_channel_update(sa, json, SLACK_CHANNEL_UNKNOWN);
+}
+
+static void rtm_channel_deleted(SlackAccount *sa, json_value *json) {
+	slack_channel_update(sa, json, SLACK_CHANNEL_DELETED);
+}
+
+static void rtm_resync(SlackAccount *sa);
+
+static void rtm_hello(SlackAccount *sa, json_value *json) {
+	if (PURPLE_CONNECTION_IS_CONNECTED(sa->gc))
+		rtm_resync(sa);
+	else
+		slack_users_load(sa);
+}
+
+static const struct rtm_handler {
+	const char *type;
+	void (*handle)(SlackAccount *sa, json_value *json);
+} rtm_handlers[] = {
+	{ "message",               slack_message },
+	{ "user_typing",           slack_user_typing },
+	{ "presence_change",       slack_presence_change },
+	{ "presence_change_batch", slack_presence_change },
+	{ "im_close",              slack_im_close },
+	{ "im_open",               slack_im_open },
+	/* not necessarily (and probably in reality never) open, but works as no-op in that case */
+	{ "im_created",            slack_im_open },
+	{ "member_joined_channel", rtm_member_joined },
+	{ "member_left_channel",   rtm_member_left },
+	{ "user_changed",          slack_user_changed },
+	{ "team_join",             slack_user_changed },
+	{ "channel_joined",        rtm_channel_member },
+	{ "group_joined",          rtm_channel_group },
+	{ "group_unarchive",       rtm_channel_group },
+	{ "channel_left",          rtm_channel_public },
+	{ "channel_created",       rtm_channel_public },
+	{ "channel_unarchive",     rtm_channel_public },
+	{ "channel_rename",        rtm_channel_unknown },
+	{ "group_rename",          rtm_channel_unknown },
+	{ "channel_archive",       rtm_channel_deleted },
+	{ "channel_deleted",       rtm_channel_deleted },
+	{ "group_archive",         rtm_channel_deleted },
+	{ "group_left",            rtm_channel_deleted },
+	{ "hello",                 rtm_hello },
+};
+
+static const struct rtm_handler *rtm_handler_find(const char *type, size_t len) {
+	for (unsigned i = 0; i < G_N_ELEMENTS(rtm_handlers); i ++)
+		if (!strncmp(rtm_handlers[i].type, type, len) && !rtm_handlers[i].type[len])
+			return &rtm_handlers[i];
+	return NULL;
+}
+
 static void rtm_msg(SlackAccount *sa, const char *type, json_value *json) {
-	if (!strcmp(type, "message")) {
-		slack_message(sa, json);
-	}
-	else if (!strcmp(type, "user_typing")) {
-		slack_user_typing(sa, json);
-	}
-	else if (!strcmp(type, "presence_change") ||
-	         !strcmp(type, "presence_change_batch")) {
-		slack_presence_change(sa, json);
-	}
-	else if (!strcmp(type, "im_close")) {
-		slack_im_close(sa, json);
-	}
-	else if (!strcmp(type, "im_open")) {
-		slack_im_open(sa, json);
-	}
-	else if (!strcmp(type, "member_joined_channel")) {
-		slack_member_joined_channel(sa, json, TRUE);
-	}
-	else if (!strcmp(type, "member_left_channel")) {
-		slack_member_joined_channel(sa, json, FALSE);
-	}
-	else if (!strcmp(type, "user_changed") ||
-		 !strcmp(type, "team_join")) {
-		slack_user_changed(sa, json);
-	}
-	else if (!strcmp(type, "im_created")) {
-		/* not necessarily (and probably in reality never) open, but works as no-op in that case */
-		slack_im_open(sa, json);
-	}
-	else if (!strcmp(type, "channel_joined")) {
-		slack_channel_update(sa, json, SLACK_CHANNEL_MEMBER);
-	}
-	else if (!strcmp(type, "group_joined") ||
-		 !strcmp(type, "group_unarchive")) {
-		slack_channel_update(sa, json, SLACK_CHANNEL_GROUP);
-	}
-	else if (!strcmp(type, "channel_left") ||
-	         !strcmp(type, "channel_created") ||
-	         !strcmp(type, "channel_unarchive")) {
-		slack_channel_update(sa, json, SLACK_CHANNEL_PUBLIC);
-	}
-	else if (!strcmp(type, "channel_rename") ||
-		 !strcmp(type, "group_rename")) {
-		slack_channel_update(sa, json, SLACK_CHANNEL_UNKNOWN);
+	const struct rtm_handler *handler = rtm_handler_find(type, strlen(type));
+	if (handler)
+		handler->handle(sa, json);
+	else
+		purple_debug_info("slack", "Unhandled RTM type %s\n", type);
+}
+
+/* Look for the top-level "type" and "reply_to" of a frame without parsing it.
+ * Returns the raw type if it is a string with no handler and there is no reply_to, i.e., the frame can be dropped. */
+static const char *rtm_peek_unhandled(const guchar *msg, size_t len, size_t *type_len) {
+	const char *type = NULL, *name, *val;
+	unsigned name_len;
+	size_t val_len;
+	json_reader reader;
+	int r;
+
+	json_reader_init(&reader, (const char *)msg, len);
+	if (!json_reader_enter(&reader, json_object))
+		return NULL;
+
+	while ((r = json_reader_next(&reader, &name, &name_len)) > 0) {
+		if (name_len == 8 && !memcmp(name, "reply_to", 8))
+			return NULL;
+		if (!json_reader_skip(&reader, &val, &val_len))
+			return NULL;
+		if (name_len == 4 && !memcmp(name, "type", 4)) {
+			if (val_len < 2 || *val != '"' || rtm_handler_find(val + 1, val_len - 2))
+				return NULL;
+			type = val + 1;
+			*type_len = val_len - 2;
+		}
 	}
-	else if (!strcmp(type, "channel_archive") ||
-		 !strcmp(type, "channel_deleted") ||
-		 !strcmp(type, "group_archive") ||
-		 !strcmp(type, "group_left")) {
-		slack_channel_update(sa, json, SLACK_CHANNEL_DELETED);
+
+	return r ? NULL : type;
+}
+
+static void rtm_skipped(SlackAccount *sa, const char *type, size_t type_len, size_t len) {
+	char *key = g_strndup(type, type_len);
+	gpointer bytes = NULL;
+	if (g_hash_table_lookup_extended(sa->rtm_skipped, key, NULL, &bytes))
+		g_free(key);
+	else
+		purple_debug_info("slack", "Skipping unhandled RTM type %s\n", key);
+	g_hash_table_replace(sa->rtm_skipped, key, GSIZE_TO_POINTER(GPOINTER_TO_SIZE(bytes) + len));
+}
+
+static void rtm_lost(SlackAccount *sa, const char *reason);
+
+/* Keepalive: every ping_interval seconds send a ping (RTM "ping" and/or a
+ * websocket PING) carrying the monotonic send time, which comes back in the
+ * pong.  If ping_misses pings in a row go unanswered, the connection is dead. */
+
+static void rtm_rtt(SlackAccount *sa, gint64 sent) {
+	gint64 rtt = g_get_monotonic_time() - sent;
+	if (rtt < 0 || sent <= 0)
+		return;
+	sa->rtt[sa->rtt_count++ % SLACK_RTT_SAMPLES] = rtt;
+	sa->ping_unanswered = 0;
+}
+
+static void rtm_pong_cb(SlackAccount *sa, gpointer data, json_value *json, const char *error) {
+	/* pongs have no "ok", so error is always set */
+	json_value *time = json_get_prop_type(json, "time", integer);
+	if (time)
+		rtm_rtt(sa, time->u.integer);
+}
+
+static gboolean rtm_ping_cb(gpointer data) {
+	SlackAccount *sa = data;
+
+	if (!sa->rtm) {
+		sa->ping_timer = 0;
+		return FALSE;
 	}
-	else if (!strcmp(type, "hello")) {
-		slack_users_load(sa);
+
+	if (sa->ping_unanswered) {
+		sa->ping_missed ++;
+		int misses = purple_account_get_int(sa->account, "ping_misses", 2);
+		if (misses > 0 && sa->ping_unanswered >= (unsigned)misses) {
+			purple_debug_warning("slack", "RTM: no pong for %u pings\n", sa->ping_unanswered);
+			sa->ping_timer = 0;
+			rtm_lost(sa, "RTM ping timeout");
+			return FALSE;
+		}
 	}
-	else {
-		purple_debug_info("slack", "Unhandled RTM type %s\n", type);
+
+	gint64 now = g_get_monotonic_time();
+	const char *type = purple_account_get_string(sa->account, "ping_type", "rtm");
+	if (strcmp(type, "ws")) {
+		SlackJsonWriter *w = slack_rtm_begin(sa, "ping");
+		slack_json_key(w, "time");
+		slack_json_int(w, now);
+		slack_rtm_send(sa, rtm_pong_cb, NULL);
 	}
+	if (strcmp(type, "rtm"))
+		purple_websocket_send(sa->rtm, PURPLE_WEBSOCKET_PING, (guchar *)&now, sizeof(now));
+	sa->ping_unanswered ++;
+	return TRUE;
+}
+
+static void rtm_keepalive_stop(SlackAccount *sa) {
+	if (sa->ping_timer)
+		purple_timeout_remove(sa->ping_timer);
+	sa->ping_timer = 0;
+}
+
+static void rtm_keepalive_start(SlackAccount *sa) {
+	rtm_keepalive_stop(sa);
+	sa->ping_unanswered = 0;
+	int interval = purple_account_get_int(sa->account, "ping_interval", 30);
+	if (interval > 0)
+		sa->ping_timer = purple_timeout_add_seconds(interval, rtm_ping_cb, sa);
 }
 
 static void rtm_cb(PurpleWebsocket *ws, gpointer data, PurpleWebsocketOp op, const guchar *msg, size_t len) {
 	SlackAccount *sa = data;
 
-	purple_debug_misc("slack", "RTM %x: %.*s\n", op, (int)len, msg);
+	if (op == PURPLE_WEBSOCKET_TEXT)
+		purple_debug_misc("slack", "RTM %x: %.*s\n", op, (int)len, msg);
+	else
+		purple_debug_misc("slack", "RTM %x: %" G_GSIZE_FORMAT " bytes\n", op, len);
 	switch (op) {
 		case PURPLE_WEBSOCKET_TEXT:
 			break;
 		case PURPLE_WEBSOCKET_ERROR:
+			/* the websocket aborts itself after this */
+			sa->rtm = NULL;
+			rtm_lost(sa, (const char *)msg);
+			return;
 		case PURPLE_WEBSOCKET_CLOSE:
-			purple_connection_error_reason(sa->gc,
-					PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
-					(const char *)msg ?: "RTM connection closed");
+			/* the websocket aborts itself once it has replied */
 			sa->rtm = NULL;
-			break;
+			rtm_lost(sa, "RTM connection closed");
+			return;
 		case PURPLE_WEBSOCKET_OPEN:
-			purple_connection_update_progress(sa->gc, "RTM Connected", 3, SLACK_CONNECT_STEPS);
+			sa->rtm_open = TRUE;
+			if (!PURPLE_CONNECTION_IS_CONNECTED(sa->gc))
+				purple_connection_update_progress(sa->gc, "RTM Connected", 3, SLACK_CONNECT_STEPS);
+			rtm_keepalive_start(sa);
+			return;
+		case PURPLE_WEBSOCKET_PONG:
+			if (len == sizeof(gint64)) {
+				gint64 sent;
+				memcpy(&sent, msg, sizeof(sent));
+				rtm_rtt(sa, sent);
+			}
+			return;
 		default:
 			return;
 	}
 
-	json_value *json = json_parse((const char *)msg, len);
+	size_t type_len;
+	const char *skip = rtm_peek_unhandled(msg, len, &type_len);
+	if (skip) {
+		rtm_skipped(sa, skip, type_len, len);
+		return;
+	}
+
+	/* text frames are in the websocket's own input buffer, so we can parse
+	 * them in place; that mangles msg, so keep a copy to log if it fails */
+	char *orig = purple_debug_is_enabled() ? g_strndup((const char *)msg, len) : NULL;
+	json_value *json = slack_json_parse_in_situ(&sa->json, (char *)msg, len);
 	json_value *reply_to = json_get_prop_type(json, "reply_to", integer);
 	const char *type = json_get_prop_strptr(json, "type");
 
@@ -108,7 +264,7 @@ static void rtm_cb(PurpleWebsocket *ws, gpointer data, PurpleWebsocketOp op, con
 			g_hash_table_steal(sa->rtm_call, GUINT_TO_POINTER(reply_to->u.integer));
 			if (!json_get_prop_boolean(json, "ok", FALSE)) {
 				json_value *err = json_get_prop(json, "error");
-				if (err->type == json_object)
+				if (err && err->type == json_object)
 					err = json_get_prop(err, "msg");
 				err = json_get_type(err, string);
 				call->callback(call->sa, call->data, json, err ? err->u.string.ptr : "Unknown error");
@@ -120,30 +276,35 @@ static void rtm_cb(PurpleWebsocket *ws, gpointer data, PurpleWebsocketOp op, con
 	else if (type)
 		rtm_msg(sa, type, json);
 	else {
-		purple_debug_error("slack", "RTM: %.*s\n", (int)len, msg);
+		purple_debug_error("slack", "RTM: %s\n", orig ?: "(unparseable message)");
 		purple_connection_error_reason(sa->gc,
 				PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
 				"Could not parse RTM JSON");
 	}
 
-	json_value_free(json);
+	slack_json_release(&sa->json, json);
+	g_free(orig);
 }
 
 static void rtm_connect_cb(SlackAccount *sa, gpointer data, json_value *json, const char *error) {
+	gboolean reconnect = PURPLE_CONNECTION_IS_CONNECTED(sa->gc);
 
-	if (sa->rtm) {
-		purple_websocket_abort(sa->rtm);
-		sa->rtm = NULL;
-	}
+	slack_rtm_close(sa);
 
 	const char *url     = json_get_prop_strptr(json, "url");
-	if (sa->self)
-		g_object_unref(sa->self);
-	sa->self = g_object_ref(slack_user_update(sa, json_get_prop_type(json, "self", object)));
+	SlackUser *self = slack_user_update(sa, json_get_prop_type(json, "self", object));
+	if (self) {
+		if (sa->self)
+			g_object_unref(sa->self);
+		sa->self = g_object_ref(self);
+	}
 
 	if (!url || !sa->self) {
-		purple_connection_error_reason(sa->gc,
-				slack_api_connection_error(error), error ?: "Missing RTM parameters");
+		if (reconnect && slack_api_connection_error(error) == PURPLE_CONNECTION_ERROR_NETWORK_ERROR)
+			rtm_lost(sa, error ?: "Missing RTM parameters");
+		else
+			purple_connection_error_reason(sa->gc,
+					slack_api_connection_error(error), error ?: "Missing RTM parameters");
 		return;
 	}
 
@@ -161,12 +322,233 @@ static void rtm_connect_cb(SlackAccount *sa, gpointer data, json_value *json, co
 
 #undef SET_STR
 
-	/* now that we have team info... */
-	slack_blist_init(sa);
+	if (!reconnect) {
+		/* now that we have team info... */
+		slack_blist_init(sa);
+		purple_connection_update_progress(sa->gc, "Connecting to RTM", 2, SLACK_CONNECT_STEPS);
+	}
 
-	purple_connection_update_progress(sa->gc, "Connecting to RTM", 2, SLACK_CONNECT_STEPS);
 	purple_debug_info("slack", "RTM URL: %s\n", url);
-	sa->rtm = purple_websocket_connect(sa->account, url, NULL, rtm_cb, sa);
+	sa->rtm_open = FALSE;
+	sa->rtm = purple_websocket_connect(sa->account, url, NULL,
+			purple_account_get_bool(sa->account, "rtm_deflate", TRUE) ? PURPLE_WEBSOCKET_DEFLATE : 0,
+			rtm_cb, sa);
+}
+
+void slack_rtm_report(SlackAccount *sa) {
+	if (sa->rtm) {
+		const PurpleWebsocketStats *stats = purple_websocket_get_stats(sa->rtm);
+		purple_debug_info("slack", "RTM: %" G_GUINT64_FORMAT " messages, %" G_GUINT64_FORMAT " bytes received as %" G_GUINT64_FORMAT " (%s, %" G_GINT64_FORMAT " us inflating)\n",
+				stats->messages_in, stats->payload_in, stats->wire_in,
+				stats->deflate ? "compressed" : "uncompressed", stats->inflate_usec);
+		purple_debug_info("slack", "RTM: %" G_GUINT64_FORMAT " frames sent in %" G_GUINT64_FORMAT " writes\n",
+				stats->frames_out, stats->flush_writes);
+		double secs = stats->opened ? (g_get_monotonic_time() - stats->opened) / 1e6 : 0;
+		purple_debug_info("slack", "RTM: %" G_GUINT64_FORMAT " read wakeups (%.2f/s, %" G_GUINT64_FORMAT " at the read limit), %.2f frames per wakeup\n",
+				stats->read_wakeups, secs > 0 ? stats->read_wakeups / secs : 0, stats->read_limited,
+				stats->read_wakeups ? (double)stats->frames_in / stats->read_wakeups : 0);
+		purple_debug_info("slack", "RTM: %" G_GSIZE_FORMAT " bytes buffered (peak %" G_GSIZE_FORMAT "), %" G_GUINT64_FORMAT " grows, %" G_GUINT64_FORMAT " shrinks\n",
+				stats->buffer_size, stats->buffer_peak, stats->buffer_grows, stats->buffer_shrinks);
+	}
+
+	GHashTableIter iter;
+	gpointer type, bytes;
+	g_hash_table_iter_init(&iter, sa->rtm_skipped);
+	while (g_hash_table_iter_next(&iter, &type, &bytes))
+		purple_debug_info("slack", "RTM type %s: skipped %" G_GSIZE_FORMAT " bytes\n", (char *)type, GPOINTER_TO_SIZE(bytes));
+}
+
+static int rtt_cmp(const void *a, const void *b) {
+	gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+	return (x > y) - (x < y);
+}
+
+char *slack_rtm_info(SlackAccount *sa) {
+	/* histogram bucket upper bounds, ms */
+	static const unsigned bounds[] = { 25, 50, 100, 200, 400, 800, 1600 };
+	GString *info = g_string_new(NULL);
+
+	g_string_append_printf(info, "<b>RTM:</b> %s<br>", sa->rtm ? "connected" : "disconnected");
+	unsigned n = MIN(sa->rtt_count, SLACK_RTT_SAMPLES);
+	if (n) {
+		gint64 rtt[SLACK_RTT_SAMPLES];
+		memcpy(rtt, sa->rtt, n * sizeof(*rtt));
+		qsort(rtt, n, sizeof(*rtt), rtt_cmp);
+		g_string_append_printf(info, "<b>Round trip time:</b> %.1f ms<br>",
+				sa->rtt[(sa->rtt_count - 1) % SLACK_RTT_SAMPLES] / 1e3);
+		g_string_append_printf(info, "<b>Last %u pings:</b> min %.1f, median %.1f, max %.1f ms<br>",
+				n, rtt[0] / 1e3, rtt[n/2] / 1e3, rtt[n-1] / 1e3);
+
+		unsigned i = 0, b;
+		for (b = 0; b <= G_N_ELEMENTS(bounds); b++) {
+			unsigned c = 0;
+			while (i < n && (b == G_N_ELEMENTS(bounds) || rtt[i] < bounds[b] * 1000))
+				c++, i++;
+			if (b < G_N_ELEMENTS(bounds))
+				g_string_append_printf(info, "&nbsp;&lt; %u ms: %u<br>", bounds[b], c);
+			else
+				g_string_append_printf(info, "&nbsp;&ge; %u ms: %u<br>", bounds[b-1], c);
+		}
+	} else
+		g_string_append(info, "<b>Round trip time:</b> unknown<br>");
+	g_string_append_printf(info, "<b>Pings missed:</b> %u (%u outstanding)<br>", sa->ping_missed, sa->ping_unanswered);
+
+	if (sa->rtm) {
+		const PurpleWebsocketStats *stats = purple_websocket_get_stats(sa->rtm);
+		g_string_append_printf(info, "<b>Received:</b> %" G_GUINT64_FORMAT " messages, %" G_GUINT64_FORMAT " bytes (%" G_GUINT64_FORMAT " on the wire, %s)<br>",
+				stats->messages_in, stats->payload_in, stats->wire_in, stats->deflate ? "compressed" : "uncompressed");
+		g_string_append_printf(info, "<b>Sent:</b> %" G_GUINT64_FORMAT " frames in %" G_GUINT64_FORMAT " writes<br>",
+				stats->frames_out, stats->flush_writes);
+		g_string_append_printf(info, "<b>Reads:</b> %" G_GUINT64_FORMAT " wakeups, %.2f frames per wakeup<br>",
+				stats->read_wakeups, stats->read_wakeups ? (double)stats->frames_in / stats->read_wakeups : 0);
+		g_string_append_printf(info, "<b>Buffers:</b> %" G_GSIZE_FORMAT " bytes (peak %" G_GSIZE_FORMAT "), grown %" G_GUINT64_FORMAT ", shrunk %" G_GUINT64_FORMAT " times<br>",
+				stats->buffer_size, stats->buffer_peak, stats->buffer_grows, stats->buffer_shrinks);
+	}
+
+	return g_string_free(info, FALSE);
+}
+
+void slack_rtm_close(SlackAccount *sa) {
+	rtm_keepalive_stop(sa);
+	if (sa->rtm_reconnect)
+		purple_timeout_remove(sa->rtm_reconnect);
+	sa->rtm_reconnect = 0;
+	if (sa->rtm)
+		purple_websocket_abort(sa->rtm);
+	sa->rtm = NULL;
+}
+
+/* In-place reconnect: once connected, losing the websocket just means
+ * getting a new one from rtm.connect, keeping everything already loaded,
+ * and then fetching whatever was missed in open conversations (rtm_resync).
+ * Only after a longer outage are the user and conversation lists reloaded
+ * too, in the background: a failure there is retried, not a disconnect.
+ * The first attempt is immediate, after that backing off, and giving up
+ * (with a connection error, so a full login) after RTM_RECONNECT_MAX. */
+#define RTM_RECONNECT_MAX 5
+#define RTM_RESYNC_COUNT 100
+/* outage (s) after which the lists are reloaded as well, and the retries
+ * (and delay) if that fails */
+#define RTM_RELOAD_AFTER 300
+#define RTM_RELOAD_MAX 3
+#define RTM_RELOAD_RETRY 60
+
+/* Replies to calls sent on the old websocket will never come.  (Unlike
+ * slack_rtm_cancel, this is an error to the callback, not a cancellation.) */
+static void rtm_calls_fail(SlackAccount *sa, const char *error) {
+	GHashTableIter iter;
+	gpointer key, value;
+	GSList *calls = NULL;
+
+	/* callbacks may send again, so empty the table first */
+	g_hash_table_iter_init(&iter, sa->rtm_call);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		g_hash_table_iter_steal(&iter);
+		calls = g_slist_prepend(calls, value);
+	}
+
+	while (calls) {
+		SlackRTMCall *call = calls->data;
+		calls = g_slist_delete_link(calls, calls);
+		call->callback(call->sa, call->data, NULL, error);
+		g_free(call);
+	}
+}
+
+static gboolean rtm_reconnect_cb(gpointer data) {
+	SlackAccount *sa = data;
+	sa->rtm_reconnect = 0;
+	slack_rtm_close(sa);
+	rtm_calls_fail(sa, "Connection lost");
+
+	sa->rtm_reconnects ++;
+	slack_api_call(sa, rtm_connect_cb, NULL, "rtm.connect", "batch_presence_aware", "1", "presence_sub", "true", NULL);
+	return FALSE;
+}
+
+static void rtm_lost(SlackAccount *sa, const char *reason) {
+	rtm_keepalive_stop(sa);
+	if (!sa->rtm_lost_at)
+		sa->rtm_lost_at = g_get_monotonic_time();
+	if (sa->rtm_reconnect)
+		return;
+
+	if (!PURPLE_CONNECTION_IS_CONNECTED(sa->gc) || sa->rtm_reconnects >= RTM_RECONNECT_MAX) {
+		purple_connection_error_reason(sa->gc,
+				PURPLE_CONNECTION_ERROR_NETWORK_ERROR, reason ?: "RTM connection lost");
+		return;
+	}
+
+	purple_debug_warning("slack", "RTM: %s, reconnecting (attempt %u)\n", reason ?: "connection lost", sa->rtm_reconnects + 1);
+	if (sa->rtm_reconnects)
+		sa->rtm_reconnect = purple_timeout_add_seconds(1 << sa->rtm_reconnects, rtm_reconnect_cb, sa);
+	else
+		sa->rtm_reconnect = purple_timeout_add(0, rtm_reconnect_cb, sa);
+}
+
+static void rtm_resync_object(SlackAccount *sa, SlackObject *obj) {
+	slack_ts since = obj->last_ts ?: sa->last_ts;
+	if (since)
+		slack_get_history(sa, obj, since, RTM_RESYNC_COUNT);
+}
+
+/* Reload users, IMs, channels and groups (one reload at a time), which
+ * ends by resubscribing to presence.  FALSE if one is already running. */
+static gboolean rtm_reload(SlackAccount *sa) {
+	if (sa->rtm_reloading)
+		return FALSE;
+	sa->rtm_reloading = TRUE;
+	slack_users_load(sa);
+	return TRUE;
+}
+
+static gboolean rtm_reload_cb(gpointer data) {
+	SlackAccount *sa = data;
+	sa->rtm_reload_timer = 0;
+	rtm_reload(sa);
+	return FALSE;
+}
+
+void slack_rtm_reload_done(SlackAccount *sa, const char *error) {
+	sa->rtm_reloading = FALSE;
+	if (!error) {
+		sa->rtm_reload_fails = 0;
+		return;
+	}
+
+	if (++sa->rtm_reload_fails > RTM_RELOAD_MAX) {
+		purple_debug_error("slack", "RTM: reloading lists failed (%s), giving up\n", error);
+		sa->rtm_reload_fails = 0;
+		return;
+	}
+	purple_debug_warning("slack", "RTM: reloading lists failed (%s), retrying in %d s\n", error, RTM_RELOAD_RETRY);
+	if (!sa->rtm_reload_timer)
+		sa->rtm_reload_timer = purple_timeout_add_seconds(RTM_RELOAD_RETRY, rtm_reload_cb, sa);
+}
+
+static void rtm_resync(SlackAccount *sa) {
+	gint64 outage = sa->rtm_lost_at ? g_get_monotonic_time() - sa->rtm_lost_at : 0;
+	purple_debug_info("slack", "RTM: reconnected after %u attempts (%.1f s)\n", sa->rtm_reconnects, outage / 1e6);
+	sa->rtm_reconnects = 0;
+	sa->rtm_lost_at = 0;
+
+	/* changes to users and conversations (rather than messages) aren't in
+	 * the history, so after long enough, load everything again */
+	if (outage < (gint64)RTM_RELOAD_AFTER * G_USEC_PER_SEC || !rtm_reload(sa))
+		slack_presence_sub(sa);
+
+	/* catch up on open conversations */
+	GHashTableIter iter;
+	gpointer key, value;
+	g_hash_table_iter_init(&iter, sa->channels);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		if (((SlackChannel *)value)->cid)
+			rtm_resync_object(sa, value);
+
+	g_hash_table_iter_init(&iter, sa->ims);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		if (purple_find_conversation_with_account(PURPLE_CONV_TYPE_IM, ((SlackUser *)value)->name, sa->account))
+			rtm_resync_object(sa, value);
 }
 
 void slack_rtm_cancel(SlackRTMCall *call) {
@@ -175,22 +557,33 @@ void slack_rtm_cancel(SlackRTMCall *call) {
 	g_free(call);
 }
 
-void slack_rtm_send(SlackAccount *sa, SlackRTMCallback *callback, gpointer user_data, const char *type, ...) {
-	gulong id = ++sa->rtm_id;
+SlackJsonWriter *slack_rtm_begin(SlackAccount *sa, const char *type) {
+	SlackJsonWriter *w = &sa->rtm_out;
+	g_string_truncate(w->buf, 0);
+	slack_json_writer_init(w, w->buf);
+	slack_json_begin_object(w);
+	slack_json_key(w, "id");
+	slack_json_int(w, ++sa->rtm_id);
+	slack_json_key(w, "type");
+	slack_json_string(w, type);
+	return w;
+}
 
-	GString *json = g_string_new(NULL);
-	g_string_printf(json, "{\"id\":%lu,\"type\":\"%s\"", id, type);
-	va_list qargs;
-	va_start(qargs, type);
-	const char *key;
-	while ((key = va_arg(qargs, const char*))) {
-		const char *val = va_arg(qargs, const char*);
-		g_string_append_printf(json, ",\"%s\":%s", key, val);
-	}
-	va_end(qargs);
-	g_string_append_c(json, '}');
+void slack_rtm_send(SlackAccount *sa, SlackRTMCallback *callback, gpointer user_data) {
+	gulong id = sa->rtm_id;
+	GString *json = sa->rtm_out.buf;
+
+	slack_json_end_object(&sa->rtm_out);
 	g_return_if_fail(json->len <= 16384);
 
+	if (!sa->rtm || !sa->rtm_open) {
+		/* between websockets, reconnecting (frames can't be sent before open) */
+		purple_debug_warning("slack", "RTM not connected, dropping: %.*s\n", (int)json->len, json->str);
+		if (callback)
+			callback(sa, user_data, NULL, "Not connected");
+		return;
+	}
+
 	purple_debug_misc("slack", "RTM: %.*s\n", (int)json->len, json->str);
 
 	if (callback) {
@@ -202,7 +595,6 @@ void slack_rtm_send(SlackAccount *sa, SlackRTMCallback *callback, gpointer user_
 	}
 
 	purple_websocket_send(sa->rtm, PURPLE_WEBSOCKET_TEXT, (guchar*)json->str, json->len);
-	g_string_free(json, TRUE);
 }
 
 void slack_rtm_connect(SlackAccount *sa) {
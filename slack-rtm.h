@@ -9,8 +9,17 @@ typedef struct _SlackRTMCall SlackRTMCall;
 typedef void SlackRTMCallback(SlackAccount *sa, gpointer user_data, json_value *json, const char *error);
 
 void slack_rtm_connect(SlackAccount *sa);
-/* Send an RTM message of the given type (unquoted, escaped json string) with the given key (unquoted, escaped json string), value (const char *json) pairs */
-void slack_rtm_send(SlackAccount *sa, SlackRTMCallback *callback, gpointer user_data, const char *type, /* const char *key1, const char *json1, */ ...) G_GNUC_NULL_TERMINATED;
+/* Start an RTM message of the given type: add any other members to the returned (per-account) writer, then call slack_rtm_send */
+SlackJsonWriter *slack_rtm_begin(SlackAccount *sa, const char *type);
+void slack_rtm_send(SlackAccount *sa, SlackRTMCallback *callback, gpointer user_data);
 void slack_rtm_cancel(SlackRTMCall *call);
+/* Log RTM traffic (and compression) totals, and how many bytes of each unhandled RTM type were dropped unparsed */
+void slack_rtm_report(SlackAccount *sa);
+/* Connection status, round trip times and traffic, as HTML */
+char *slack_rtm_info(SlackAccount *sa);
+/* Stop the keepalive and abort the websocket */
+void slack_rtm_close(SlackAccount *sa);
+/* The lists reloaded after a reconnect are all in, or one failed with error */
+void slack_rtm_reload_done(SlackAccount *sa, const char *error);
 
 #endif
@@ -5,6 +5,7 @@
 #include "slack-blist.h"
 #include "slack-user.h"
 #include "slack-im.h"
+#include "slack-rtm.h"
 
 G_DEFINE_TYPE(SlackUser, slack_user, SLACK_TYPE_OBJECT);
 
@@ -25,8 +26,37 @@ static void slack_user_class_init(SlackUserClass *klass) {
 static void slack_user_init(SlackUser *self) {
 }
 
+struct user_json {
+	const char *id;
+	gboolean deleted;
+	const char *name;
+	json_value *profile;
+};
+
+static const SlackJsonField user_fields[] = {
+	SLACK_JSON_FIELD(struct user_json, id,      "id",      STRING),
+	SLACK_JSON_FIELD(struct user_json, deleted, "deleted", BOOLEAN),
+	SLACK_JSON_FIELD(struct user_json, name,    "name",    STRING),
+	SLACK_JSON_FIELD(struct user_json, profile, "profile", OBJECT),
+};
+static SlackJsonSchema user_schema = SLACK_JSON_SCHEMA(user_fields);
+
+struct profile_json {
+	const char *status_text;
+	const char *current_status;
+};
+
+static const SlackJsonField profile_fields[] = {
+	SLACK_JSON_FIELD(struct profile_json, status_text,    "status_text",    STRING),
+	SLACK_JSON_FIELD(struct profile_json, current_status, "current_status", STRING),
+};
+static SlackJsonSchema profile_schema = SLACK_JSON_SCHEMA(profile_fields);
+
 SlackUser *slack_user_update(SlackAccount *sa, json_value *json) {
-	const char *sid = json_get_prop_strptr(json, "id");
+	struct user_json u = { NULL };
+	slack_json_decode(&user_schema, json, &u);
+
+	const char *sid = u.id;
 	if (!sid)
 		return NULL;
 	slack_object_id id;
@@ -34,7 +64,7 @@ SlackUser *slack_user_update(SlackAccount *sa, json_value *json) {
 
 	SlackUser *user = g_hash_table_lookup(sa->users, id);
 
-	if (json_get_prop_boolean(json, "deleted", FALSE)) {
+	if (u.deleted) {
 		if (!user)
 			return NULL;
 		if (user->name)
@@ -51,7 +81,7 @@ SlackUser *slack_user_update(SlackAccount *sa, json_value *json) {
 		g_hash_table_replace(sa->users, user->object.id, user);
 	}
 
-	const char *name = json_get_prop_strptr(json, "name");
+	const char *name = u.name;
 	g_warn_if_fail(name);
 
 	if (g_strcmp0(user->name, name)) {
@@ -66,10 +96,10 @@ SlackUser *slack_user_update(SlackAccount *sa, json_value *json) {
 			purple_blist_rename_buddy(user->buddy, user->name);
 	}
 
-	json_value *profile = json_get_prop_type(json, "profile", object);
-	if (profile) {
+	struct profile_json profile = { NULL };
+	if (slack_json_decode(&profile_schema, u.profile, &profile)) {
 		g_free(user->status);
-		user->status = g_strdup(json_get_prop_strptr(profile, "status_text") ?: json_get_prop_strptr(profile, "current_status"));
+		user->status = g_strdup(profile.status_text ?: profile.current_status);
 
 		if (user == sa->self)
 			purple_account_set_user_info(sa->account, sa->self->status);
@@ -82,25 +112,29 @@ void slack_user_changed(SlackAccount *sa, json_value *json) {
 	slack_user_update(sa, json_get_prop(json, "user"));
 }
 
-static void users_list_cb(SlackAccount *sa, gpointer data, json_value *json, const char *error) {
+static void users_list_item(SlackAccount *sa, gpointer data, json_value *json) {
+	slack_user_update(sa, json);
+}
 
-	json_value *members = json_get_prop_type(json, "members", array);
-	if (!members) {
-		purple_connection_error_reason(sa->gc,
-				PURPLE_CONNECTION_ERROR_NETWORK_ERROR, error ?: "Missing user list");
+static void users_list_cb(SlackAccount *sa, gpointer data, json_value *json, const char *error) {
+	if (!json_get_prop_type(json, "members", array)) {
+		if (PURPLE_CONNECTION_IS_CONNECTED(sa->gc))
+			slack_rtm_reload_done(sa, error ?: "Missing user list");
+		else
+			purple_connection_error_reason(sa->gc,
+					PURPLE_CONNECTION_ERROR_NETWORK_ERROR, error ?: "Missing user list");
 		return;
 	}
 
-	g_hash_table_remove_all(sa->users);
-	for (unsigned i = 0; i < members->u.array.length; i ++)
-		slack_user_update(sa, members->u.array.values[i]);
-
 	slack_ims_load(sa);
 }
 
+/* Also used to reload everything after a long RTM outage, keeping (and
+ * updating) what's already loaded. */
 void slack_users_load(SlackAccount *sa) {
-	purple_connection_update_progress(sa->gc, "Loading Users", 4, SLACK_CONNECT_STEPS);
-	slack_api_call(sa, users_list_cb, NULL, "users.list", "presence", "false", NULL);
+	if (!PURPLE_CONNECTION_IS_CONNECTED(sa->gc))
+		g_hash_table_remove_all(sa->users);
+	slack_api_paged_call(sa, users_list_cb, users_list_item, "members", NULL, "Loading Users", 4, "users.list", "presence", "false", NULL);
 }
 
 static void presence_set(SlackAccount *sa, json_value *json, const char *presence) {
@@ -211,5 +245,5 @@ void slack_get_info(PurpleConnection *gc, const char *who) {
 	if (!user)
 		users_info_cb(sa, g_strdup(who), NULL, NULL);
 	else
-		slack_api_call(sa, users_info_cb, g_strdup(who), "users.info", "user", user->object.id, NULL);
+		slack_api_call_full(sa, users_info_cb, g_strdup(who), g_free, "users.info", "user", user->object.id, NULL);
 }
@@ -94,13 +94,6 @@ static void slack_conversation_updated(PurpleConversation *conv, PurpleConvUpdat
 	slack_mark_conversation(sa, conv);
 }
 
-static void slack_conversation_deleted(PurpleConversation *conv, void *data) {
-	SlackAccount *sa = get_slack_account(conv->account);
-	if (!sa)
-		return;
-	g_free(purple_conversation_get_data(conv, "slack:ts"));
-}
-
 static void slack_login(PurpleAccount *account) {
 	PurpleConnection *gc = purple_account_get_connection(account);
 
@@ -109,8 +102,6 @@ static void slack_login(PurpleAccount *account) {
 		signals_connected = TRUE;
 		purple_signal_connect(purple_conversations_get_handle(), "conversation-updated",
 				gc->prpl, PURPLE_CALLBACK(slack_conversation_updated), NULL);
-		purple_signal_connect(purple_conversations_get_handle(), "deleting-conversation",
-				gc->prpl, PURPLE_CALLBACK(slack_conversation_deleted), NULL);
 	}
 
 	const gchar *token = purple_account_get_string(account, "api_token", NULL);
@@ -120,6 +111,15 @@ static void slack_login(PurpleAccount *account) {
 			PURPLE_CONNECTION_ERROR_INVALID_SETTINGS, "API token required");
 		return;
 	}
+	/* it goes in a header, so nothing but the token itself (pasted with a newline, say) */
+	char *stripped = g_strstrip(g_strdup(token));
+	if (!*stripped || strpbrk(stripped, "\r\n"))
+	{
+		g_free(stripped);
+		purple_connection_error_reason(gc,
+			PURPLE_CONNECTION_ERROR_INVALID_SETTINGS, "Invalid API token");
+		return;
+	}
 
 	SlackAccount *sa = g_new0(SlackAccount, 1);
 	gc->proto_data = sa;
@@ -129,9 +129,14 @@ static void slack_login(PurpleAccount *account) {
 	const char *host = strrchr(account->username, '@');
 	sa->api_url = g_strdup_printf("https://%s/api", host ? host+1 : "slack.com");
 
-	sa->token = g_strdup(purple_url_encode(token));
+	sa->token = stripped;
+	slack_api_init(sa);
+
+	slack_json_arena_init(&sa->json);
 
 	sa->rtm_call = g_hash_table_new_full(g_direct_hash,        g_direct_equal,        NULL, (GDestroyNotify)slack_rtm_cancel);
+	sa->rtm_skipped = g_hash_table_new_full(g_str_hash,        g_str_equal,           g_free, NULL);
+	slack_json_writer_init(&sa->rtm_out, g_string_sized_new(1024));
 
 	sa->users    = g_hash_table_new_full(slack_object_id_hash, slack_object_id_equal, NULL, g_object_unref);
 	sa->user_names = g_hash_table_new_full(g_str_hash,         g_str_equal,           NULL, NULL);
@@ -166,9 +171,16 @@ static void slack_close(PurpleConnection *gc) {
 	if (!sa)
 		return;
 
-	if (sa->rtm)
-		purple_websocket_abort(sa->rtm);
+	slack_rtm_report(sa);
+	slack_api_report(sa);
+	slack_rtm_close(sa);
+	if (sa->rtm_reload_timer)
+		purple_timeout_remove(sa->rtm_reload_timer);
+	slack_api_close(sa);
 	g_hash_table_destroy(sa->rtm_call);
+	g_hash_table_destroy(sa->rtm_skipped);
+	g_string_free(sa->rtm_out.buf, TRUE);
+	slack_json_arena_destroy(&sa->json);
 
 	if (sa->roomlist)
 		purple_roomlist_unref(sa->roomlist);
@@ -192,6 +204,25 @@ static void slack_close(PurpleConnection *gc) {
 	gc->proto_data = NULL;
 }
 
+static void slack_connection_info(PurplePluginAction *action) {
+	PurpleConnection *gc = action->context;
+	SlackAccount *sa = gc->proto_data;
+	if (!sa)
+		return;
+
+	char *rtm = slack_rtm_info(sa);
+	char *api = slack_api_info(sa);
+	char *info = g_strconcat(rtm, api, NULL);
+	g_free(rtm);
+	g_free(api);
+	purple_notify_formatted(gc, "Connection Info", "Connection Info", sa->team.name, info, NULL, NULL);
+	g_free(info);
+}
+
+static GList *slack_actions(PurplePlugin *plugin, gpointer context) {
+	return g_list_append(NULL, purple_plugin_action_new("Connection Info", slack_connection_info));
+}
+
 static PurplePluginProtocolInfo prpl_info = {
 	/* options */
 	OPT_PROTO_CHAT_TOPIC
@@ -294,7 +325,7 @@ static PurplePluginInfo info = {
 	NULL,
 	&prpl_info,	/* extra info */
 	NULL,
-	NULL,
+	slack_actions,
 	NULL,
 	NULL,
 	NULL,
@@ -315,6 +346,36 @@ static void init_plugin(G_GNUC_UNUSED PurplePlugin *plugin)
 	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
 		purple_account_option_bool_new("Retrieve unread history on open", "get_history", FALSE));
 
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+		purple_account_option_bool_new("Compress RTM traffic (permessage-deflate)", "rtm_deflate", TRUE));
+
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+		purple_account_option_int_new("Keepalive ping interval (seconds, 0 to disable)", "ping_interval", 30));
+
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+		purple_account_option_int_new("Missed pings before reconnecting (0 never)", "ping_misses", 2));
+
+	GList *ping_types = NULL;
+	static const char *const ping_type_names[][2] = {
+		{ "RTM ping", "rtm" },
+		{ "Websocket ping", "ws" },
+		{ "Both", "both" },
+	};
+	for (unsigned i = 0; i < G_N_ELEMENTS(ping_type_names); i++) {
+		PurpleKeyValuePair *kvp = g_new0(PurpleKeyValuePair, 1);
+		kvp->key = g_strdup(ping_type_names[i][0]);
+		kvp->value = g_strdup(ping_type_names[i][1]);
+		ping_types = g_list_append(ping_types, kvp);
+	}
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+		purple_account_option_list_new("Keepalive ping type", "ping_type", ping_types));
+
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+		purple_account_option_int_new("Users and channels to load per request (0 for all at once)", "page_size", SLACK_API_PAGE_SIZE));
+
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+		purple_account_option_bool_new("Reuse connections for API calls (HTTP keep-alive)", "http_keepalive", TRUE));
+
 	slack_cmd_register();
 }
 
@@ -5,21 +5,64 @@
 
 #include <account.h>
 
+#include "purple-http-pool.h"
 #include "purple-websocket.h"
+#include "slack-json.h"
+#include "slack-object.h"
 
 #define SLACK_PLUGIN_ID "prpl-slack"
 
 #define SLACK_CONNECT_STEPS 8
 
+#define SLACK_RTT_SAMPLES 64
+
+/* API call queues: interactive, background (see slack-api.c) */
+#define SLACK_API_PRIORITIES 2
+
+typedef struct _SlackAPIQueueStats {
+	guint64 sent; /* calls sent from the queue */
+	gint64 wait_usec, max_wait_usec; /* total and longest time spent queued */
+	guint peak; /* most calls queued at once */
+} SlackAPIQueueStats;
+
 typedef struct _SlackAccount {
 	PurpleAccount *account;
 	PurpleConnection *gc;
 	char *api_url; /* e.g., "https://slack.com/api" */
-	char *token; /* url encoded */
+	char *token; /* sent as Authorization: Bearer, never in urls */
+	char *api_headers; /* for every API request */
+	PurpleHttpPool *http; /* keep-alive connections for API calls, or NULL to fetch each */
+	GHashTable *api_calls; /* SlackAPICall set, queued or in flight */
+	GHashTable *api_buckets; /* char *method -> SlackAPIBucket */
+	GHashTable *api_pending; /* char *url -> SlackAPICall, for coalescing */
+	GQueue api_queue[SLACK_API_PRIORITIES]; /* SlackAPICall waiting to be sent */
+	SlackAPIQueueStats api_stats[SLACK_API_PRIORITIES];
+	unsigned api_inflight;
+	guint api_timer; /* for the next call a bucket will allow */
+	guint64 api_ratelimited; /* 429s */
+	guint64 api_coalesced; /* calls answered by an identical one already pending */
 
 	PurpleWebsocket *rtm;
+	gboolean rtm_open; /* rtm has finished connecting (and so can be sent on) */
 	gulong rtm_id;
 	GHashTable *rtm_call; /* unsigned rtm_id -> SlackRTMCall */
+	GHashTable *rtm_skipped; /* char *type -> gsize bytes of unhandled frames dropped */
+	SlackJsonWriter rtm_out; /* outgoing RTM message being built */
+	guint rtm_reconnect; /* timer for pending in-place reconnect */
+	unsigned rtm_reconnects; /* reconnect attempts since the last hello */
+	gint64 rtm_lost_at; /* when (monotonic) the websocket was lost, until the next hello */
+	gboolean rtm_reloading; /* user and conversation lists being reloaded after a reconnect */
+	guint rtm_reload_timer; /* to retry a failed reload */
+	unsigned rtm_reload_fails; /* reloads failed in a row */
+	slack_ts last_ts; /* most recent message seen on RTM */
+
+	guint ping_timer; /* keepalive */
+	unsigned ping_unanswered; /* pings sent since the last pong */
+	unsigned ping_missed; /* total pings not answered within an interval */
+	gint64 rtt[SLACK_RTT_SAMPLES]; /* ring of recent round trip times (usec) */
+	unsigned rtt_count; /* total samples: the latest is rtt[(rtt_count-1) % SLACK_RTT_SAMPLES] */
+
+	SlackJsonArena json; /* for all RTM and API responses */
 
 	struct _SlackTeam {
 		char *id;